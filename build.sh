@@ -7,9 +7,20 @@ clang \
     -std=c99 -pedantic \
     -Wall -Wextra \
     -O3 \
+    -pthread \
     snake.c \
     -o snake
 
+clang \
+    -DSERVER \
+    -ggdb \
+    -std=c99 -pedantic \
+    -Wall -Wextra \
+    -O3 \
+    -pthread \
+    snake.c \
+    -o snake-server
+
 clang \
     -DWASM \
     --target=wasm32 -nostartfiles -nostdlib -Wl,--no-entry \
@@ -27,7 +38,28 @@ clang \
     -std=c99 -pedantic \
     -Wall -Wextra \
     -O3 \
+    -pthread \
     snake.c \
     test_framework.c \
     -o snake-test
 
+clang \
+    -DBENCH \
+    -ggdb \
+    -std=c99 -pedantic \
+    -Wall -Wextra \
+    -O3 \
+    -march=native \
+    snake.c \
+    -o snake-bench
+
+clang \
+    -DLIB \
+    -ggdb \
+    -std=c99 -pedantic \
+    -Wall -Wextra \
+    -O3 \
+    -march=native \
+    -shared -fPIC -fvisibility=hidden \
+    snake.c \
+    -o libsnake.so
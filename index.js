@@ -64,6 +64,12 @@ window.onload = () => {
     const LEFT   = 3;
     const REPLAY = 4;
     const QUIT   = 5;
+
+    // Returned by `update` when nothing will happen until there is input,
+    // in which case the main loop stops until the next key press
+    const UPDATE_ON_INPUT = -1;
+    let resume_main_loop = null;
+
     let input = -1;
     window.addEventListener("keydown", (event) => {
         switch (event.key) {
@@ -74,6 +80,11 @@ window.onload = () => {
             case 'r':           input = REPLAY; break;
             case 'q':           input = QUIT  ; break;
         }
+        if (resume_main_loop !== null) {
+            const resume = resume_main_loop;
+            resume_main_loop = null;
+            resume();
+        }
     });
 
     WebAssembly.instantiateStreaming(
@@ -152,6 +163,10 @@ window.onload = () => {
                 t0 = t1;
                 update_interval = update();
             }
+            if (update_interval == UPDATE_ON_INPUT) {
+                resume_main_loop = () => requestAnimationFrame(mainLoop);
+                return;
+            }
             requestAnimationFrame(mainLoop);
         }
         requestAnimationFrame(mainLoop);
@@ -1,18 +1,37 @@
 #ifndef WASM
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef SERVER
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#endif
+
 #else
 
 typedef unsigned long size_t;
+#define NULL ((void*) 0)
 
 __attribute__((import_name("rand")))
 int rand(void);
@@ -46,6 +65,24 @@ void wasm_terminal_clear(void);
 
 #endif
 
+// The batched engine is only needed by the tests, the benchmark and the
+// library
+#if defined(TEST) || defined(BENCH) || defined(LIB)
+#define BATCH
+#endif
+
+// Only the terminal game and its tests write through a separate thread
+#if !defined(WASM) && !defined(SERVER) && !defined(BENCH) && !defined(LIB)
+#define TERMINAL_WRITER
+#endif
+
+#ifdef LIB
+// The library is built with -fvisibility=hidden, so only the API is exported
+#define LIB_EXPORT __attribute__((visibility("default")))
+#else
+#define LIB_EXPORT
+#endif
+
 typedef struct vec {
     size_t x;
     size_t y;
@@ -57,8 +94,17 @@ typedef enum direction {
     DOWN  = 2,
     LEFT  = 3,
 } Direction;
-const int REPLAY = 4;
-const int QUIT   = 5;
+// Inputs besides the directions, constants so that they can be case labels
+enum {
+    REPLAY  = 4,
+    QUIT    = 5,
+    REWIND  = 6,
+    FORWARD = 7,
+};
+
+// Returned by `update` instead of an interval when nothing will happen until
+// there is input
+const float UPDATE_ON_INPUT = -1;
 
 typedef enum out_of_game_task {
     SETUP                         = 0,
@@ -68,6 +114,690 @@ typedef enum out_of_game_task {
     TEARDOWN                      = 4,
 } OutOfGameTask;
 
+#ifndef WASM
+
+//
+// High scores
+//
+// A fixed-size table in a memory-mapped file, shared by every process that
+// maps it. A record is a single 64-bit word, score in the high half and unix
+// time in the low half, so records are updated with compare-and-swap and
+// read without locks or syscalls.
+//
+// Submitting replaces the smallest record if the new one is larger. Records
+// only ever grow, so a record that was the smallest when we looked can't be
+// undercut by another one meanwhile; a failed CAS just means someone else
+// got there first and we rescan. The table therefore always holds the
+// HIGH_SCORES_COUNT largest records ever submitted. Nothing is fsync'd, the
+// kernel writes the pages back in its own time.
+//
+
+#define HIGH_SCORES_COUNT 64
+#define HIGH_SCORES_MAGIC 0x31657263536b6e53ull // "SnkScre1"
+
+typedef struct high_scores {
+    unsigned long long magic;
+    unsigned long long records[HIGH_SCORES_COUNT];
+} HighScores;
+
+// Returns NULL if the file can't be used, in which case scores aren't kept
+HighScores* high_scores_open(char* path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1)
+        return NULL;
+
+    // Growing a short or new file zero-fills it, which is an empty table.
+    // Racing processes all truncate to the same size, so that is harmless.
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1
+            || (file_stat.st_size < (off_t) sizeof(HighScores)
+                && ftruncate(fd, sizeof(HighScores)) == -1)) {
+        close(fd);
+        return NULL;
+    }
+
+    HighScores* high_scores = mmap(NULL, sizeof(HighScores),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (high_scores == MAP_FAILED)
+        return NULL;
+
+    unsigned long long magic = 0;
+    __atomic_compare_exchange_n(&high_scores->magic, &magic, HIGH_SCORES_MAGIC,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (magic != 0 && magic != HIGH_SCORES_MAGIC) {
+        munmap(high_scores, sizeof(HighScores));
+        return NULL;
+    }
+
+    return high_scores;
+}
+
+// Returns 1 if the score made it into the table
+int high_scores_submit(HighScores* high_scores, size_t score, unsigned int time) {
+    if (score == 0)
+        return 0;
+
+    unsigned long long record = (unsigned long long) score<<32 | time;
+
+    for (;;) {
+        size_t             min_idx = 0;
+        unsigned long long min     = ~0ull;
+        for (size_t i = 0; i < HIGH_SCORES_COUNT; ++i) {
+            unsigned long long other = __atomic_load_n(high_scores->records + i,
+                                                       __ATOMIC_ACQUIRE);
+            if (other < min) {
+                min     = other;
+                min_idx = i;
+            }
+        }
+
+        if (record <= min)
+            return 0;
+
+        if (__atomic_compare_exchange_n(high_scores->records + min_idx, &min, record,
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+}
+
+size_t high_scores_best(HighScores* high_scores) {
+    unsigned long long best = 0;
+    for (size_t i = 0; i < HIGH_SCORES_COUNT; ++i) {
+        unsigned long long record = __atomic_load_n(high_scores->records + i,
+                                                    __ATOMIC_ACQUIRE);
+        if (record > best)
+            best = record;
+    }
+    return best>>32;
+}
+
+// Copies up to `n` records, best first, into `records`. Returns the number
+// of records copied.
+size_t high_scores_top(HighScores* high_scores, unsigned long long* records, size_t n) {
+    size_t count = 0;
+    for (size_t i = 0; i < HIGH_SCORES_COUNT; ++i) {
+        unsigned long long record = __atomic_load_n(high_scores->records + i,
+                                                    __ATOMIC_ACQUIRE);
+        if (record == 0)
+            continue;
+
+        // Insertion sort into the output, dropping whatever falls off the end
+        size_t j = count < n ? count++ : n;
+        while (j > 0 && records[j-1] < record) {
+            if (j < n)
+                records[j] = records[j-1];
+            --j;
+        }
+        if (j < n)
+            records[j] = record;
+    }
+    return count;
+}
+
+// $SNAKE_HIGH_SCORES, or ~/.snake-high-scores
+HighScores* high_scores_open_default(void) {
+    char* path = getenv("SNAKE_HIGH_SCORES");
+    if (path)
+        return high_scores_open(path);
+
+    char* home = getenv("HOME");
+    if (!home)
+        return NULL;
+
+    char home_path[4096];
+    snprintf(home_path, sizeof(home_path), "%s/.snake-high-scores", home);
+    return high_scores_open(home_path);
+}
+
+//
+// Levels
+//
+// A level file is mapped read-only and used in place, there's no parsing:
+//
+//     Level header, 24 bytes
+//     LevelSpawn    spawns[spawns_count], 8 bytes each
+//     unsigned char walls[(width*height + 7)/8], 1 bit per cell, row-major
+//
+// Integers are little-endian. Opening checks the header, the file size, the
+// spawns and that there is room for food, and touches nothing else, so the
+// walls are only paged in when a game starts. Then they are stamped into the grid as cells the
+// snake occupies, which makes walls collisions and keeps food off them
+// without any extra lookup.
+//
+// Level files are made from text with `snake --make-level`, see
+// `level_make`.
+//
+
+#define LEVEL_MAGIC 0x316c76654c6b6e53ull // "SnkLevl1"
+
+typedef struct level_spawn {
+    unsigned short x;
+    unsigned short y;
+    unsigned short direction;
+    unsigned short reserved;
+} LevelSpawn;
+
+typedef struct level {
+    unsigned long long magic;
+    unsigned int       width;
+    unsigned int       height;
+    unsigned int       spawns_count;
+    unsigned int       reserved;
+    LevelSpawn         spawns[];
+} Level;
+
+size_t level_size(Level* level) {
+    return sizeof(Level) + level->spawns_count*sizeof(LevelSpawn)
+         + ((size_t) level->width*level->height + 7)/8;
+}
+
+unsigned char* level_walls(Level* level) {
+    return (unsigned char*) (level->spawns + level->spawns_count);
+}
+
+size_t level_wall_at(Level* level, Vec pos) {
+    size_t idx = pos.y*level->width + pos.x;
+    return level_walls(level)[idx>>3]>>(idx & 7) & 1;
+}
+
+void level_close(Level* level) {
+    munmap(level, level_size(level));
+}
+
+// Returns NULL if the file isn't a valid level
+Level* level_open(char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < (off_t) sizeof(Level)) {
+        close(fd);
+        return NULL;
+    }
+
+    Level* level = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (level == MAP_FAILED)
+        return NULL;
+
+    // Spawn coordinates are 16 bits, which also keeps the size from
+    // overflowing
+    size_t valid = level->magic == LEVEL_MAGIC
+                && level->width  >= 1 && level->width  <= 0xffff
+                && level->height >= 1 && level->height <= 0xffff
+                && level->spawns_count >= 1
+                && level->spawns_count <= (size_t) file_stat.st_size/sizeof(LevelSpawn)
+                && level_size(level) == (size_t) file_stat.st_size;
+    for (size_t i = 0; valid && i < level->spawns_count; ++i) {
+        LevelSpawn* spawn = &level->spawns[i];
+        valid = spawn->x < level->width && spawn->y < level->height
+             && spawn->direction <= LEFT
+             && !level_wall_at(level, (Vec) {.x = spawn->x, .y = spawn->y});
+    }
+    // A spawn and a free cell besides it for food, or placing the food never
+    // ends. Stops at the second free cell, only levels that are almost all
+    // walls are read through.
+    unsigned char* walls      = level_walls(level);
+    size_t         cells      = (size_t) level->width*level->height;
+    size_t         open_cells = 0;
+    for (size_t idx = 0; valid && open_cells < 2 && idx < cells; ++idx) {
+        // 8 walls at a time
+        if ((idx & 7) == 0 && idx + 8 <= cells && walls[idx>>3] == 0xff) {
+            idx += 7;
+            continue;
+        }
+        open_cells += !(walls[idx>>3]>>(idx & 7) & 1);
+    }
+    if (open_cells < 2)
+        valid = 0;
+    if (!valid) {
+        munmap(level, file_stat.st_size);
+        return NULL;
+    }
+
+    return level;
+}
+
+// Fills a grid of the level's dimensions with its walls. A wall is a snake
+// cell that is never retracted, the head cell value doubling as "occupied".
+void level_fill_grid(Level* level, unsigned char* grid) {
+    // Each nibble of the bitmap becomes a byte of 4 cells
+    static const unsigned char wall_cells[16] = {
+        0x00, 0x02, 0x08, 0x0a, 0x20, 0x22, 0x28, 0x2a,
+        0x80, 0x82, 0x88, 0x8a, 0xa0, 0xa2, 0xa8, 0xaa,
+    };
+
+    unsigned char* walls     = level_walls(level);
+    size_t         grid_size = ((size_t) level->width*level->height + 3)>>2;
+    for (size_t i = 0; i < grid_size; ++i)
+        grid[i] = wall_cells[walls[i>>1]>>((i & 1)<<2) & 15];
+
+    // The last byte may have cells past the end of the grid
+    size_t cells = (size_t) level->width*level->height;
+    if (cells & 3)
+        grid[grid_size - 1] &= (1<<((cells & 3)<<1)) - 1;
+}
+
+// Makes a level file from text, one character per cell and one line per
+// row: `#` is a wall, `^ > v <` are spawn points facing that way and
+// anything else is empty. Returns 0 on success.
+int level_make(FILE* text, char* path) {
+    size_t text_size     = 0;
+    size_t text_capacity = 4096;
+    char*  text_buf      = malloc(text_capacity);
+    size_t n;
+    while (text_buf && (n = fread(text_buf + text_size, 1, text_capacity - text_size, text)) > 0) {
+        text_size += n;
+        if (text_size == text_capacity) {
+            text_capacity *= 2;
+            char* grown = realloc(text_buf, text_capacity);
+            if (!grown)
+                free(text_buf);
+            text_buf = grown;
+        }
+    }
+    if (!text_buf)
+        return -1;
+
+    // Dimensions and spawns count first
+    size_t width        = 0;
+    size_t height       = 0;
+    size_t spawns_count = 0;
+    size_t x            = 0;
+    for (size_t i = 0; i < text_size; ++i) {
+        char c = text_buf[i];
+        if (c == '\n') {
+            ++height;
+            x = 0;
+        } else if (c != '\r') {
+            if (++x > width)
+                width = x;
+            spawns_count += c == '^' || c == '>' || c == 'v' || c == '<';
+        }
+    }
+    if (x > 0)
+        ++height;
+
+    size_t         walls_size = (width*height + 7)/8;
+    unsigned char* walls      = calloc(walls_size, 1);
+    LevelSpawn*    spawns     = calloc(spawns_count ? spawns_count : 1, sizeof(LevelSpawn));
+    int failed = !walls || !spawns || spawns_count == 0
+              || width == 0 || width > 0xffff || height > 0xffff;
+
+    size_t y = 0;
+    size_t spawn_idx = 0;
+    x = 0;
+    for (size_t i = 0; !failed && i < text_size; ++i) {
+        char c = text_buf[i];
+        if (c == '\n') {
+            ++y;
+            x = 0;
+        } else if (c != '\r') {
+            size_t idx = y*width + x;
+            switch (c) {
+                case '#': walls[idx>>3] |= 1<<(idx & 7); break;
+                case '^': spawns[spawn_idx++] = (LevelSpawn) {.x = x, .y = y, .direction = UP   }; break;
+                case '>': spawns[spawn_idx++] = (LevelSpawn) {.x = x, .y = y, .direction = RIGHT}; break;
+                case 'v': spawns[spawn_idx++] = (LevelSpawn) {.x = x, .y = y, .direction = DOWN }; break;
+                case '<': spawns[spawn_idx++] = (LevelSpawn) {.x = x, .y = y, .direction = LEFT }; break;
+            }
+            ++x;
+        }
+    }
+
+    Level header = {
+        .magic        = LEVEL_MAGIC,
+        .width        = width,
+        .height       = height,
+        .spawns_count = spawns_count,
+    };
+
+    FILE* out = failed ? NULL : fopen(path, "wb");
+    failed = !out
+          || fwrite(&header, sizeof(header), 1, out) != 1
+          || fwrite(spawns, sizeof(LevelSpawn), spawns_count, out) != spawns_count
+          || fwrite(walls, 1, walls_size, out) != walls_size;
+    if (out && fclose(out) != 0)
+        failed = 1;
+
+    free(text_buf);
+    free(walls);
+    free(spawns);
+
+    return failed ? -1 : 0;
+}
+
+#endif // not WASM
+
+#if defined(TEST) || defined(BENCH)
+
+//
+// Headless VT100 screen emulator
+//
+// Consumes the bytes we would otherwise `write` to the terminal and rebuilds
+// the screen as a matrix of codepoints, so that tests and the benchmark can
+// check what was drawn and count what it cost. Only the subset of sequences
+// we emit is understood: CUP, ED and DECTCEM (cursor hide/show) plus UTF-8
+// text. Anything else is counted in `unknown_sequences`.
+//
+
+#define VT_MAX_PARAMS 16
+
+typedef enum vt_parse_state {
+    VT_GROUND = 0,
+    VT_ESCAPE = 1,
+    VT_CSI    = 2,
+} VtParseState;
+
+typedef struct vt {
+    Vec           dims;
+    unsigned int* cells;
+
+    Vec cursor;
+    int cursor_visible;
+
+    VtParseState parse_state;
+    size_t       params[VT_MAX_PARAMS];
+    size_t       params_count;
+    int          params_private;
+
+    unsigned int utf8_codepoint;
+    size_t       utf8_remaining;
+
+    // Accounting, reset with `vt_reset_counters`
+    size_t bytes;
+    size_t escape_sequences;
+    size_t cursor_moves;
+    size_t printed_chars;
+    size_t clipped_chars;
+    size_t unknown_sequences;
+} Vt;
+
+void vt_reset_counters(Vt* vt) {
+    vt->bytes             = 0;
+    vt->escape_sequences  = 0;
+    vt->cursor_moves      = 0;
+    vt->printed_chars     = 0;
+    vt->clipped_chars     = 0;
+    vt->unknown_sequences = 0;
+}
+
+void vt_erase(Vt* vt, size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i)
+        vt->cells[i] = ' ';
+}
+
+// `cells` must hold `dims.x*dims.y` codepoints
+void vt_init(Vt* vt, unsigned int* cells, Vec dims) {
+    vt->dims  = dims;
+    vt->cells = cells;
+    vt_erase(vt, 0, dims.x*dims.y);
+
+    vt->cursor = (Vec) {.x = 0, .y = 0};
+    vt->cursor_visible = 1;
+
+    vt->parse_state    = VT_GROUND;
+    vt->utf8_remaining = 0;
+
+    vt_reset_counters(vt);
+}
+
+unsigned int vt_at(Vt* vt, size_t x, size_t y) {
+    return vt->cells[y*vt->dims.x + x];
+}
+
+void vt_put(Vt* vt, unsigned int codepoint) {
+    if (vt->cursor.x < vt->dims.x && vt->cursor.y < vt->dims.y) {
+        vt->cells[vt->cursor.y*vt->dims.x + vt->cursor.x] = codepoint;
+        ++vt->printed_chars;
+    } else {
+        ++vt->clipped_chars;
+    }
+    ++vt->cursor.x;
+}
+
+void vt_dispatch_csi(Vt* vt, char final) {
+    size_t* params = vt->params;
+    size_t  params_count = vt->params_count;
+
+    ++vt->escape_sequences;
+
+    if (vt->params_private) {
+        if (params_count == 1 && params[0] == 25 && (final == 'l' || final == 'h')) {
+            vt->cursor_visible = final == 'h';
+            return;
+        }
+        ++vt->unknown_sequences;
+        return;
+    }
+
+    switch (final) {
+        case 'H': case 'f': {
+            // Parameters are 1-based and default to 1
+            size_t row = params_count > 0 && params[0] ? params[0] : 1;
+            size_t col = params_count > 1 && params[1] ? params[1] : 1;
+            vt->cursor.y = row - 1 < vt->dims.y ? row - 1 : vt->dims.y - 1;
+            vt->cursor.x = col - 1 < vt->dims.x ? col - 1 : vt->dims.x - 1;
+            ++vt->cursor_moves;
+        }; break;
+        case 'J': {
+            size_t cursor_idx = vt->cursor.y*vt->dims.x + vt->cursor.x;
+            size_t mode = params_count > 0 ? params[0] : 0;
+            switch (mode) {
+                case 0: vt_erase(vt, cursor_idx, vt->dims.x*vt->dims.y); break;
+                case 1: vt_erase(vt, 0         , cursor_idx + 1       ); break;
+                case 2: vt_erase(vt, 0         , vt->dims.x*vt->dims.y); break;
+                default: ++vt->unknown_sequences;
+            }
+        }; break;
+        default: ++vt->unknown_sequences;
+    }
+}
+
+void vt_feed(Vt* vt, char* buf, size_t n) {
+    vt->bytes += n;
+
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = buf[i];
+        switch (vt->parse_state) {
+            case VT_GROUND: {
+                if (vt->utf8_remaining) {
+                    if ((c & 0xC0) == 0x80) {
+                        vt->utf8_codepoint = vt->utf8_codepoint<<6 | (c & 0x3F);
+                        if (--vt->utf8_remaining == 0)
+                            vt_put(vt, vt->utf8_codepoint);
+                        break;
+                    }
+                    // Truncated sequence, emit the replacement character and
+                    // reprocess the current byte
+                    vt->utf8_remaining = 0;
+                    vt_put(vt, 0xFFFD);
+                }
+
+                if (c == '\033') {
+                    vt->parse_state = VT_ESCAPE;
+                } else if (c < 0x20 || c == 0x7F) {
+                    // We never emit other control characters
+                    ++vt->unknown_sequences;
+                } else if (c < 0x80) {
+                    vt_put(vt, c);
+                } else if ((c & 0xE0) == 0xC0) {
+                    vt->utf8_codepoint = c & 0x1F;
+                    vt->utf8_remaining = 1;
+                } else if ((c & 0xF0) == 0xE0) {
+                    vt->utf8_codepoint = c & 0x0F;
+                    vt->utf8_remaining = 2;
+                } else if ((c & 0xF8) == 0xF0) {
+                    vt->utf8_codepoint = c & 0x07;
+                    vt->utf8_remaining = 3;
+                } else {
+                    vt_put(vt, 0xFFFD);
+                }
+            }; break;
+            case VT_ESCAPE: {
+                if (c == '[') {
+                    vt->parse_state    = VT_CSI;
+                    vt->params[0]      = 0;
+                    vt->params_count   = 0;
+                    vt->params_private = 0;
+                } else {
+                    ++vt->escape_sequences;
+                    ++vt->unknown_sequences;
+                    vt->parse_state = VT_GROUND;
+                }
+            }; break;
+            case VT_CSI: {
+                if (c >= '0' && c <= '9') {
+                    if (vt->params_count == 0)
+                        vt->params_count = 1;
+                    size_t* param = vt->params + vt->params_count - 1;
+                    *param = *param*10 + (c - '0');
+                } else if (c == ';') {
+                    if (vt->params_count == 0)
+                        vt->params_count = 1;
+                    if (vt->params_count < VT_MAX_PARAMS)
+                        vt->params[vt->params_count++] = 0;
+                } else if (c == '?' && vt->params_count == 0) {
+                    vt->params_private = 1;
+                } else if (c >= 0x40 && c <= 0x7E) {
+                    vt_dispatch_csi(vt, c);
+                    vt->parse_state = VT_GROUND;
+                }
+            }; break;
+        }
+    }
+}
+
+#endif // TEST or BENCH
+
+#ifdef TERMINAL_WRITER
+
+//
+// Terminal writer thread
+//
+// Writes to a terminal block whenever it is slow, or stopped altogether with
+// ctrl-s, so the terminal game leaves them to a thread of its own and never
+// waits on stdout itself. Output is handed over through a single-producer
+// single-consumer ring: only the game thread advances `head` and only the
+// writer advances `tail`, so neither side takes a lock or waits for the
+// other. The writer sleeps on a semaphore while the ring is empty.
+//
+
+// Must be a power of 2
+#define TERMINAL_RING_SIZE (1<<16)
+
+typedef struct terminal_writer {
+    int       fd;
+    int       stop;
+    sem_t     wake;
+    pthread_t thread;
+
+    // Free-running, masked on access
+    size_t head;
+    size_t tail;
+    char   ring[TERMINAL_RING_SIZE];
+} TerminalWriter;
+
+void* terminal_writer_run(void* writer_ptr) {
+    TerminalWriter* writer = writer_ptr;
+
+    for (;;) {
+        size_t head = __atomic_load_n(&writer->head, __ATOMIC_ACQUIRE);
+        size_t tail = writer->tail;
+        if (tail == head) {
+            // Everything handed over before `stop` was set has been written
+            if (__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE))
+                break;
+            sem_wait(&writer->wake);
+            continue;
+        }
+
+        // Up to the end of the ring, the rest goes on the next round
+        size_t offset = tail & (TERMINAL_RING_SIZE - 1);
+        size_t n      = head - tail;
+        if (n > TERMINAL_RING_SIZE - offset)
+            n = TERMINAL_RING_SIZE - offset;
+
+        ssize_t written = write(writer->fd, writer->ring + offset, n);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // stdout shares its file description, and so O_NONBLOCK,
+                // with stdin
+                struct pollfd out_pollfd = {.fd = writer->fd, .events = POLLOUT};
+                poll(&out_pollfd, 1, -1);
+                continue;
+            }
+            // The terminal is gone, there's no point in keeping anything
+            written = head - tail;
+        }
+        __atomic_store_n(&writer->tail, tail + written, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+// NULL if the thread can't be started
+TerminalWriter* terminal_writer_start(int fd) {
+    TerminalWriter* writer = calloc(1, sizeof(TerminalWriter));
+    if (!writer)
+        return NULL;
+    writer->fd = fd;
+
+    sem_init(&writer->wake, 0, 0);
+    if (pthread_create(&writer->thread, NULL, terminal_writer_run, writer) != 0) {
+        sem_destroy(&writer->wake);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+// Hands over as much of `bytes` as there is room for and returns how much
+// that was, like a non-blocking `write`
+size_t terminal_writer_push(TerminalWriter* writer, char* bytes, size_t n) {
+    size_t head = writer->head;
+    size_t tail = __atomic_load_n(&writer->tail, __ATOMIC_ACQUIRE);
+
+    size_t room = TERMINAL_RING_SIZE - (head - tail);
+    if (n > room)
+        n = room;
+    if (n == 0)
+        return 0;
+
+    size_t offset = head & (TERMINAL_RING_SIZE - 1);
+    size_t first  = n < TERMINAL_RING_SIZE - offset ? n : TERMINAL_RING_SIZE - offset;
+    memcpy(writer->ring + offset, bytes, first);
+    memcpy(writer->ring, bytes + first, n - first);
+    __atomic_store_n(&writer->head, head + n, __ATOMIC_RELEASE);
+
+    // Only enters the kernel if the writer is asleep
+    sem_post(&writer->wake);
+
+    return n;
+}
+
+// Returns once everything handed over has been written
+void terminal_writer_stop(TerminalWriter* writer) {
+    __atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&writer->wake);
+    pthread_join(writer->thread, NULL);
+
+    sem_destroy(&writer->wake);
+    free(writer);
+}
+
+#endif // TERMINAL_WRITER
+
+#ifndef WASM
+// Unsent output is capped at this by default, see `terminal_flush_out`
+#define TERMINAL_OUT_MAX (1<<20)
+#endif
+
 typedef struct state {
     Vec terminal_dims;
 
@@ -95,19 +825,50 @@ typedef struct state {
     OutOfGameTask out_of_game_task;
 
 #ifndef WASM
-    char* terminal_out;
-    char* terminal_out_write_ptr;
+    // Defaults to STDIN_FILENO when zero-initialized
+    int terminal_in_fd;
+    int terminal_out_fd;
+
+    // The frame being built, after any output that couldn't be sent yet.
+    // Grows as needed up to `terminal_out_max`, 0 for TERMINAL_OUT_MAX.
+    char*  terminal_out;
+    size_t terminal_out_len;
+    size_t terminal_out_capacity;
+    size_t terminal_out_max;
+    int    terminal_out_overflowed;
+#ifdef TERMINAL_WRITER
+    // When set, output is handed to the writer thread instead of written
+    TerminalWriter* terminal_writer;
+#endif
 
     struct termios orig_terminal_config;
+
+    // NULL if scores aren't kept
+    HighScores* high_scores;
+
+    // NULL if ticks aren't journaled, see the rewind journal
+    struct journal* journal;
+
+    // NULL for an empty board the size of the terminal
+    Level* level;
+#endif
+#if defined(TEST) || defined(BENCH)
+    // When set, output is fed to the emulator instead of written to stdout
+    Vt* vt;
 #endif
 } State;
 
-int capture_input(void) {
+int capture_input(State* state) {
 #ifndef WASM
     char input_buf[1024];
-    int n = read(1, input_buf, 1024);
+    int n = read(state->terminal_in_fd, input_buf, 1024);
+    // The terminal or connection is gone, e.g. stdin at EOF or a hung up
+    // pty. Nobody can play any more, and waiting for input would return
+    // straight away, again and again.
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return QUIT;
     if (n != -1) {
-        for (size_t i = 0; i < n; ++i) {
+        for (int i = 0; i < n; ++i) {
             char c = input_buf[i];
             switch (c) {
                 case 'w': case 'k': return UP;
@@ -116,6 +877,8 @@ int capture_input(void) {
                 case 'd': case 'l': return RIGHT;
                 case 'r':           return REPLAY;
                 case 'q':           return QUIT;
+                case '[':           return REWIND;
+                case ']':           return FORWARD;
             }
         }
     }
@@ -134,22 +897,22 @@ typedef struct ioctl_terminal_winsize {
     unsigned short ws_ypixel;
 } IOCtlTerminalWinsize;
 
-Vec get_terminal_dims(void) {
+Vec get_terminal_dims(State* state) {
 #ifndef WASM
     Vec dims;
 
     IOCtlTerminalWinsize ioctl_winsize;
-    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ioctl_winsize) == -1) {
-        // Fallback values
-        dims.x = 80;
-        dims.y = 24;
-    } else {
-        // We need reduce the grid width by 1 to prevent the Gnome terminal
-        // from scrolling when we write to the bottom right corner of the
-        // terminal
-        dims.x = ioctl_winsize.ws_col - 1;
-        dims.y = ioctl_winsize.ws_row;
+    if (ioctl(state->terminal_in_fd, TIOCGWINSZ, &ioctl_winsize) == -1) {
+        // Fallback values, e.g. for server sessions, whose sockets have no
+        // window size
+        ioctl_winsize.ws_col = 80;
+        ioctl_winsize.ws_row = 24;
     }
+    // We need reduce the grid width by 1 to prevent the Gnome terminal
+    // from scrolling when we write to the bottom right corner of the
+    // terminal
+    dims.x = ioctl_winsize.ws_col - 1;
+    dims.y = ioctl_winsize.ws_row;
 
     return dims;
 #else
@@ -158,41 +921,80 @@ Vec get_terminal_dims(void) {
 #endif
 }
 
-void terminal_write(State* state, char* str) {
 #ifndef WASM
-    while (*str != '\0')
-        *state->terminal_out_write_ptr++ = *str++;
-#else
+
+// Makes room for `n` more bytes of output. Fails once unsent output would
+// exceed the cap, and from then on until the frame is flushed, so that the
+// rest of the frame is dropped as a whole.
+int terminal_out_reserve(State* state, size_t n) {
+    if (state->terminal_out_overflowed)
+        return 0;
+
+    size_t max    = state->terminal_out_max ? state->terminal_out_max : TERMINAL_OUT_MAX;
+    size_t needed = state->terminal_out_len + n;
+    if (needed > max) {
+        state->terminal_out_overflowed = 1;
+        return 0;
+    }
+
+    if (needed > state->terminal_out_capacity) {
+        size_t capacity = state->terminal_out_capacity ? state->terminal_out_capacity : 1024;
+        while (capacity < needed)
+            capacity *= 2;
+
+        char* out = realloc(state->terminal_out, capacity);
+        if (!out) {
+            state->terminal_out_overflowed = 1;
+            return 0;
+        }
+        state->terminal_out          = out;
+        state->terminal_out_capacity = capacity;
+    }
+
+    return 1;
+}
+
+void terminal_out_free(State* state) {
+    free(state->terminal_out);
+    state->terminal_out          = NULL;
+    state->terminal_out_len      = 0;
+    state->terminal_out_capacity = 0;
+}
+
+void terminal_write_bytes(State* state, char* bytes, size_t n) {
+    if (!terminal_out_reserve(state, n))
+        return;
+    memcpy(state->terminal_out + state->terminal_out_len, bytes, n);
+    state->terminal_out_len += n;
+}
+
+#endif // not WASM
+
+void terminal_write(State* state, char* str) {
     size_t str_len = 0;
     while (str[str_len] != '\0')
         ++str_len;
+#ifndef WASM
+    terminal_write_bytes(state, str, str_len);
+#else
     wasm_terminal_write(str, str_len);
 #endif
 }
 
 void terminal_write_int(State* state, size_t x) {
 #ifndef WASM
-    char* ptr_bottom = state->terminal_out_write_ptr;
+    // Enough for 64 bits
+    char digits[20];
+    char* ptr = digits + sizeof(digits);
 
     // Push digits on the string in reverse order
     do {
         size_t prev_x = x;
         x /= 10;
-        *state->terminal_out_write_ptr++ = (prev_x - x*10) + '0';
+        *--ptr = (prev_x - x*10) + '0';
     } while (x);
 
-    char* ptr_top = state->terminal_out_write_ptr;
-
-    // Swap the digits on the string
-    while (ptr_bottom < ptr_top) {
-        --ptr_top;
-
-        char tmp    = *ptr_bottom;
-        *ptr_bottom = *ptr_top;
-        *ptr_top    = tmp;
-
-        ++ptr_bottom;
-    }
+    terminal_write_bytes(state, ptr, digits + sizeof(digits) - ptr);
 #else
     wasm_terminal_write_int(x);
 #endif
@@ -200,12 +1002,11 @@ void terminal_write_int(State* state, size_t x) {
 
 void terminal_move_cursor(State* state, size_t x, size_t y) {
 #ifndef WASM
-    *state->terminal_out_write_ptr++ = '\033';
-    *state->terminal_out_write_ptr++ = '[';
+    terminal_write_bytes(state, "\033[", 2);
     terminal_write_int(state, y+1);
-    *state->terminal_out_write_ptr++ = ';';
+    terminal_write_bytes(state, ";", 1);
     terminal_write_int(state, x+1);
-    *state->terminal_out_write_ptr++ = 'H';
+    terminal_write_bytes(state, "H", 1);
 #else
     wasm_terminal_move_cursor(x, y);
 #endif
@@ -214,15 +1015,17 @@ void terminal_move_cursor(State* state, size_t x, size_t y) {
 void terminal_write_multiline(State* state, size_t x, size_t y, char* str) {
     terminal_move_cursor(state, x, y);
     while (*str != '\0') {
-#ifndef WASM
-        while (*str != '\n' && *str != '\0')
-            *state->terminal_out_write_ptr++ = *str++;
-#else
         size_t str_len = 0;
-        while (str[str_len] != '\n' && *str != '\n')
+        while (str[str_len] != '\n' && str[str_len] != '\0')
             ++str_len;
+#ifndef WASM
+        terminal_write_bytes(state, str, str_len);
+#else
         wasm_terminal_write(str, str_len);
 #endif
+        str += str_len;
+        if (*str == '\n')
+            ++str;
         ++y;
         terminal_move_cursor(state, x, y);
     }
@@ -233,23 +1036,9 @@ void terminal_move_cursor_to_grid_pos(State* state, Vec pos) {
                                 pos.y   + state->grid_offset.y);
 }
 
-void terminal_flush_out(State* state) {
-#ifndef WASM
-    write(STDOUT_FILENO,
-          state->terminal_out,
-          state->terminal_out_write_ptr - state->terminal_out);
-    state->terminal_out_write_ptr = state->terminal_out;
-#else
-    wasm_terminal_flush_out();
-#endif
-}
-
 void terminal_clear(State* state) {
 #ifndef WASM
-    *state->terminal_out_write_ptr++ = '\033';
-    *state->terminal_out_write_ptr++ = '[';
-    *state->terminal_out_write_ptr++ = '2';
-    *state->terminal_out_write_ptr++ = 'J';
+    terminal_write_bytes(state, "\033[2J", 4);
 #else
     wasm_terminal_clear();
 #endif
@@ -258,21 +1047,11 @@ void terminal_clear(State* state) {
 #ifndef WASM
 
 void terminal_hide_cursor(State* state) {
-    *state->terminal_out_write_ptr++ = '\033';
-    *state->terminal_out_write_ptr++ = '[';
-    *state->terminal_out_write_ptr++ = '?';
-    *state->terminal_out_write_ptr++ = '2';
-    *state->terminal_out_write_ptr++ = '5';
-    *state->terminal_out_write_ptr++ = 'l';
+    terminal_write_bytes(state, "\033[?25l", 6);
 }
 
 void terminal_restore_cursor(State* state) {
-    *state->terminal_out_write_ptr++ = '\033';
-    *state->terminal_out_write_ptr++ = '[';
-    *state->terminal_out_write_ptr++ = '?';
-    *state->terminal_out_write_ptr++ = '2';
-    *state->terminal_out_write_ptr++ = '5';
-    *state->terminal_out_write_ptr++ = 'h';
+    terminal_write_bytes(state, "\033[?25h", 6);
 }
 #endif // not WASM
 
@@ -292,6 +1071,16 @@ unsigned char snake_at(
     return (state->grid[idx>>2] >> ((idx & 3)<<1)) & 3;
 }
 
+// Whether there's a free cell for food, only looking as far as the first
+size_t grid_has_room(State* state) {
+    size_t cells = state->grid_dims.x*state->grid_dims.y;
+    for (size_t idx = 0; idx < cells; ++idx) {
+        if (!((state->grid[idx>>2] >> ((idx & 3)<<1)) & 3))
+            return 1;
+    }
+    return 0;
+}
+
 void snake_start(
     State* state,
     Vec pos
@@ -300,6 +1089,25 @@ void snake_start(
     state->grid[idx>>2] |= 2<<((idx & 3)<<1);
 }
 
+// The browser build has no allocator, so the grid lives at the top of the
+// heap and is released with `brk`
+void grid_alloc(State* state, size_t grid_size) {
+#ifndef WASM
+    state->grid = malloc(grid_size);
+#else
+    state->grid = sbrk(grid_size);
+#endif
+}
+
+void grid_free(State* state) {
+#ifndef WASM
+    free(state->grid);
+#else
+    brk(state->grid);
+#endif
+    state->grid = NULL;
+}
+
 size_t snake_extend_head(State* state) {
     unsigned char* grid = state->grid;
     Vec grid_dims = state->grid_dims;
@@ -366,234 +1174,2152 @@ void snake_retract_tail(State* state) {
     state->snake_tail_direction = direction;
 }
 
-State state;
-
-#ifdef WASM
-__attribute__((export_name("update")))
+void terminal_draw_end_screen(State* state) {
+    size_t x = (state->terminal_dims.x>>1) - 8;
+    size_t y = (state->terminal_dims.y>>1) - 3;
+    terminal_move_cursor(state, x, y);
+    terminal_write(state, "   GAME OVER!   ");
+    terminal_move_cursor(state, x, ++y);
+    terminal_write(state, "                ");
+    terminal_move_cursor(state, x, ++y);
+    terminal_write(state, " Final Score: ");
+    terminal_write_int(state, state->score);
+    terminal_write(state, " ");
+#ifndef WASM
+    if (state->high_scores) {
+        terminal_move_cursor(state, x, ++y);
+        terminal_write(state, "  High Score: ");
+        terminal_write_int(state, high_scores_best(state->high_scores));
+        terminal_write(state, " ");
+    }
 #endif
-float update(void) {
-    if (state.do_in_game_update) {
-        state.snake_head_prev_direction = state.snake_head_direction;
-        int input = capture_input();
-        if (input == QUIT) {
+    terminal_move_cursor(state, x, ++y);
+    terminal_write(state, "                ");
+    terminal_move_cursor(state, x, ++y);
+    terminal_write(state, "    r=replay    ");
 #ifndef WASM
-            state.do_in_game_update = 0;
-            state.out_of_game_task = TEARDOWN;
-            return state.update_interval;
+    terminal_move_cursor(state, x, ++y);
+    terminal_write(state, "    q=quit      ");
+    if (state->journal) {
+        terminal_move_cursor(state, x, ++y);
+        terminal_write(state, "   [ ]=rewind   ");
+    }
 #endif
-        } else if (input != -1) {
-            state.snake_head_direction = input;
-        }
-
-        if (!snake_extend_head(&state)) {
-            state.do_in_game_update = 0;
-            state.out_of_game_task = END_SCREEN;
-            return state.update_interval;
-        }
+}
 
-        terminal_move_cursor_to_grid_pos(&state, state.snake_head);
-        terminal_write(&state, "██");
+#ifndef WASM
 
-        if (state.snake_head.x == state.food.x && state.snake_head.y == state.food.y) {
-            state.snake_grow_countdown += state.snake_grow_increment;
+//
+// Rewind journal
+//
+// Records the last `capacity` ticks of a game so that it can be stepped
+// backwards and forwards through them, one tick at a time in constant time.
+// Only what the grid doesn't already tell us is kept, a byte per tick:
+//
+//     bits 0-1: head direction, to redo the tick
+//     bits 2-3: direction change code of the cell the tail left
+//     bit  4:   the tail moved
+//     bit  5:   food was eaten
+//
+// The head needs nothing else to be undone: the cell it left holds the
+// direction change into the tick, which gives the head direction before it,
+// and a head cell looks like a straight section of snake. The food eaten is
+// where the head ended up, so only the food placed next is recorded, as a
+// cell index in a second ring, 4 bytes per food eaten.
+//
+// `snake_head_prev_direction` is only meaningful within a tick, stepping
+// sets it to the head direction.
+//
+
+#define JOURNAL_TAIL_MOVED 0x10
+#define JOURNAL_ATE        0x20
+
+typedef struct journal {
+    // A power of 2
+    size_t capacity;
+
+    unsigned int*  foods;
+    unsigned char* ticks;
+
+    // Tick counts since reset: the oldest tick still recorded, the tick the
+    // game is at and the last tick recorded, which is after `now` if we
+    // stepped back
+    size_t first;
+    size_t now;
+    size_t last;
+
+    // Food eaten up to `now`
+    size_t eaten;
+} Journal;
+
+// `capacity` must be a power of 2
+Journal* journal_create(size_t capacity) {
+    Journal* journal = calloc(1, sizeof(Journal) + capacity*(sizeof(unsigned int) + 1));
+    if (!journal)
+        return NULL;
+
+    journal->capacity = capacity;
+    journal->foods    = (unsigned int*) (journal + 1);
+    journal->ticks    = (unsigned char*) (journal->foods + capacity);
+
+    return journal;
+}
 
-            ++state.score;
+void journal_clear(Journal* journal) {
+    journal->first = 0;
+    journal->now   = 0;
+    journal->last  = 0;
+    journal->eaten = 0;
+}
 
-            do {
-                state.food.x = rand()%state.grid_dims.x;
-                state.food.y = rand()%state.grid_dims.y;
-            } while (snake_at(&state, state.food));
-            terminal_move_cursor_to_grid_pos(&state, state.food);
-            terminal_write(&state, "▓▓");
+// Moves `pos` one cell in `direction`, wrapping around the grid
+void snake_step(Vec* pos, Direction direction, Vec grid_dims) {
+    switch (direction) {
+        case UP   : pos->y = (pos->y - 1 + grid_dims.y) % grid_dims.y; break;
+        case RIGHT: pos->x = (pos->x + 1) % grid_dims.x              ; break;
+        case DOWN : pos->y = (pos->y + 1) % grid_dims.y              ; break;
+        case LEFT : pos->x = (pos->x - 1 + grid_dims.x) % grid_dims.x; break;
+    }
+}
 
-            terminal_move_cursor(&state, state.score_pos.x, state.score_pos.y);
-            terminal_write_int(&state, state.score);
-        }
+void grid_set(State* state, Vec pos, size_t value) {
+    size_t idx = pos.y*state->grid_dims.x + pos.x;
+    state->grid[idx>>2] = value<<((idx & 3)<<1)
+                              | (state->grid[idx>>2] & ~(3<<((idx & 3)<<1)));
+}
 
-        if (state.snake_grow_countdown == 0) {
-            snake_retract_tail(&state);
+// Inverse of `snake_extend_head`, up to clearing the cell the head moved to,
+// which a failed extension never marked
+void snake_withdraw_head(State* state) {
+    Direction direction = state->snake_head_direction;
+    snake_step(&state->snake_head, (direction + 2) & 3, state->grid_dims);
 
-            terminal_move_cursor_to_grid_pos(&state, state.snake_tail);
-            terminal_write(&state, "  ");
-        } else {
-            --state.snake_grow_countdown;
-        }
+    size_t direction_change_encoding = snake_at(state, state->snake_head);
+    grid_set(state, state->snake_head, 2);
 
-        terminal_flush_out(&state);
-    } else {
-        switch (state.out_of_game_task) {
-            case SETUP: {
-#ifndef WASM
-                fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    // Inverse of `decode_direction_change`
+    state->snake_head_direction      = (direction - direction_change_encoding + 2) & 3;
+    state->snake_head_prev_direction = state->snake_head_direction;
+}
 
-                struct termios new_terminal_config;
-                tcgetattr(STDIN_FILENO, &state.orig_terminal_config);
-                new_terminal_config = state.orig_terminal_config;
-                {
-                    // Don't ignore carriage return or do mapping betwen carriage return
-                    // and newline
-                    new_terminal_config.c_iflag &= ~(IGNCR | ICRNL | INLCR);
-                    // Don't strip input characters to 7 bits
-                    new_terminal_config.c_iflag &= ~ISTRIP;
-                    // Disable parity checking and errors
-                    new_terminal_config.c_iflag &= ~(INPCK | PARMRK);
-                    // Don't do output processing
-                    new_terminal_config.c_oflag &= ~OPOST;
-                    // Disable echoing of input character back to output
-                    new_terminal_config.c_lflag &= ~(ECHO | ECHOE | ECHONL);
-                    // Enable "canonical" mode, disabling input buffering
-                    new_terminal_config.c_lflag &= ~ICANON;
-                    // See General Terminal Interface, POSIX, IEEE Std 1003.1-2024,
-                    // https://pubs.opengroup.org/onlinepubs/9799919799/basedefs/V1_chap11.html
-                    // for more info.
-                }
-                tcsetattr(STDIN_FILENO, TCSANOW, &new_terminal_config);
-#endif
-            }; /* FALLTHROUGH! */
-            case RESET: {
-                state.terminal_dims = get_terminal_dims();
-
-                state.grid_offset.x = 0;
-                state.grid_offset.y = 1;
-                state.grid_dims.x = (state.terminal_dims.x - state.grid_offset.x)>>1;
-                state.grid_dims.y = (state.terminal_dims.y - state.grid_offset.y);
-                size_t grid_size = state.grid_dims.x*state.grid_dims.y<<2;
-                state.grid = sbrk(grid_size);
-                for (size_t i = 0; i < grid_size; ++i) {
-                    state.grid[i] = 0;
-                }
+// Call after a tick, with the tail's cell as it was before retracting it or
+// -1 if it didn't move
+void journal_record(State* state, Direction direction, size_t ate, int tail_cell) {
+    Journal* journal = state->journal;
+    size_t   mask    = journal->capacity - 1;
+
+    unsigned char tick = direction;
+    if (tail_cell != -1)
+        tick |= JOURNAL_TAIL_MOVED | tail_cell<<2;
+    if (ate) {
+        tick |= JOURNAL_ATE;
+        journal->foods[journal->eaten++ & mask] = state->food.y*state->grid_dims.x + state->food.x;
+    }
+    journal->ticks[journal->now++ & mask] = tick;
 
-#ifndef WASM
-                char  terminal_out[1024];
-                state.terminal_out = terminal_out;
-                state.terminal_out_write_ptr = state.terminal_out;
-                terminal_hide_cursor(&state);
-#endif
-                terminal_clear(&state);
+    // Playing on after stepping back discards the ticks that followed
+    journal->last = journal->now;
+    if (journal->now - journal->first > journal->capacity)
+        journal->first = journal->now - journal->capacity;
+}
 
-                state.snake_head.x = (state.grid_dims.x>>1) - 5;
-                state.snake_head.y =  state.grid_dims.y>>1;
-                state.snake_tail = state.snake_head;
-                state.snake_head_prev_direction = RIGHT;
-                state.snake_head_direction      = RIGHT;
-                state.snake_tail_direction      = RIGHT;
+// Undoes the last tick, returns 0 if there's no recorded tick to undo
+size_t journal_step_back(State* state) {
+    Journal* journal = state->journal;
+    if (journal->now == journal->first)
+        return 0;
 
-                snake_start(&state, state.snake_head);
-                terminal_move_cursor_to_grid_pos(&state, state.snake_head);
-                terminal_write(&state, "              move with wasd/hjkl");
-#ifndef WASM
-                terminal_write(&state, "; q to quit");
-#endif
+    unsigned char tick = journal->ticks[--journal->now & (journal->capacity - 1)];
 
-                size_t half_circumference = state.terminal_dims.x + state.terminal_dims.y;
+    if (tick & JOURNAL_TAIL_MOVED) {
+        // Inverse of `snake_retract_tail`. Growing had stopped, and nothing
+        // was eaten as that would have restarted it.
+        Direction direction = state->snake_tail_direction;
+        size_t    direction_change_encoding = (tick>>2) & 3;
+        snake_step(&state->snake_tail, (direction + 2) & 3, state->grid_dims);
+        grid_set(state, state->snake_tail, direction_change_encoding);
+        state->snake_tail_direction = (direction - direction_change_encoding + 2) & 3;
+    } else {
+        ++state->snake_grow_countdown;
+    }
 
-                state.snake_grow_increment = half_circumference/30;
-                if (state.snake_grow_increment == 0)
-                    state.snake_grow_increment = 1;
-                state.snake_grow_countdown = state.snake_grow_increment;
+    if (tick & JOURNAL_ATE) {
+        --journal->eaten;
+        --state->score;
+        state->snake_grow_countdown -= state->snake_grow_increment;
+        state->food = state->snake_head;
+    }
 
-                state.update_interval = ((float) 10)/((float) half_circumference);
+    grid_set(state, state->snake_head, 0);
+    snake_withdraw_head(state);
+
+    return 1;
+}
+
+// Redoes the tick undone last, returns 0 if there's none
+size_t journal_step_forward(State* state) {
+    Journal* journal = state->journal;
+    if (journal->now == journal->last)
+        return 0;
+
+    size_t mask = journal->capacity - 1;
+    unsigned char tick = journal->ticks[journal->now++ & mask];
+
+    // Same as the in-game update, with input and food from the journal
+    state->snake_head_prev_direction = state->snake_head_direction;
+    state->snake_head_direction      = tick & 3;
+    snake_extend_head(state);
+
+    if (tick & JOURNAL_ATE) {
+        state->snake_grow_countdown += state->snake_grow_increment;
+        ++state->score;
+
+        unsigned int food = journal->foods[journal->eaten++ & mask];
+        state->food.x = food % state->grid_dims.x;
+        state->food.y = food / state->grid_dims.x;
+    }
+
+    if (state->snake_grow_countdown == 0)
+        snake_retract_tail(state);
+    else
+        --state->snake_grow_countdown;
+    state->snake_head_prev_direction = state->snake_head_direction;
+
+    return 1;
+}
+
+// Draws runs of walls with a cursor move each
+void terminal_draw_walls(State* state) {
+    Level* level = state->level;
+    for (size_t y = 0; y < level->height; ++y) {
+        size_t x = 0;
+        while (x < level->width) {
+            Vec pos = {.x = x, .y = y};
+            if (!level_wall_at(level, pos)) {
+                ++x;
+                continue;
+            }
+
+            terminal_move_cursor_to_grid_pos(state, pos);
+            while (pos.x < level->width && level_wall_at(level, pos)) {
+                terminal_write(state, "▒▒");
+                ++pos.x;
+            }
+            x = pos.x;
+        }
+    }
+}
+
+// Draws the score and game from scratch, without the end screen
+void terminal_draw_game(State* state) {
+    terminal_hide_cursor(state);
+    terminal_clear(state);
+
+    terminal_move_cursor(state, 0, 0);
+    terminal_write(state, "Score: ");
+    terminal_write_int(state, state->score);
+
+    // No game to draw
+    if (!state->grid)
+        return;
+
+    for (size_t y = 0; y < state->grid_dims.y; ++y) {
+        for (size_t x = 0; x < state->grid_dims.x; ++x) {
+            Vec pos = {.x = x, .y = y};
+            if (snake_at(state, pos) && !(state->level && level_wall_at(state->level, pos))) {
+                terminal_move_cursor_to_grid_pos(state, pos);
+                terminal_write(state, "██");
+            }
+        }
+    }
+    if (state->level)
+        terminal_draw_walls(state);
+    terminal_move_cursor_to_grid_pos(state, state->food);
+    terminal_write(state, "▓▓");
+}
+
+// Draws everything from scratch, after output had to be dropped
+void terminal_redraw(State* state) {
+    terminal_draw_game(state);
+    if (state->out_of_game_task == WAIT_FOR_REPLAY_OR_QUIT_INPUT)
+        terminal_draw_end_screen(state);
+}
+
+#endif // not WASM
+
+void terminal_flush_out(State* state) {
+#ifndef WASM
+    // Unsent output piled up past the cap, so whatever the terminal saw last
+    // is no base for further changes. A redraw is bounded by the grid size,
+    // so it is exempt from the cap.
+    if (state->terminal_out_overflowed) {
+        state->terminal_out_len        = 0;
+        state->terminal_out_overflowed = 0;
+
+        size_t max = state->terminal_out_max;
+        state->terminal_out_max = SIZE_MAX;
+        terminal_redraw(state);
+        state->terminal_out_max = max;
+    }
+
+    char*  out   = state->terminal_out;
+    size_t out_n = state->terminal_out_len;
+    if (out_n == 0)
+        return;
+#if defined(TEST) || defined(BENCH)
+    if (state->vt) {
+        vt_feed(state->vt, out, out_n);
+        state->terminal_out_len = 0;
+        return;
+    }
+#endif
+    ssize_t written;
+#ifdef TERMINAL_WRITER
+    if (state->terminal_writer)
+        written = terminal_writer_push(state->terminal_writer, out, out_n);
+    else
+#endif
+    written = write(state->terminal_out_fd, out, out_n);
+    if (written < 0)
+        written = 0;
+
+    // Keep whatever wasn't taken, the terminal or the writer's ring being
+    // full, and send it ahead of the next frame
+    memmove(out, out + written, out_n - written);
+    state->terminal_out_len = out_n - written;
+#else
+    wasm_terminal_flush_out();
+#endif
+}
+
+#ifdef BATCH
+
+#include "snake_env.h"
+
+//
+// Batched engine
+//
+// Steps many games in lockstep, e.g. for reinforcement learning. Game state
+// is kept in structure-of-arrays form, BATCH_LANES games per vector, so that
+// coordinates, directions and countdowns of a whole group of games are
+// updated with vector arithmetic and masks instead of per-game branches and
+// modulos. The 2-bit grid cells are read and written per lane, as each cell
+// update is a read-modify-write of a shared byte. Rules are those of the
+// in-game update, a game that collides is done and reset straight away.
+//
+// All games share the same grid dimensions. Food is placed with a per-game
+// xorshift generator, so a batch is deterministic for a given seed. A game
+// whose snake fills the grid has won, there is nowhere left for food, so it
+// is done and reset like a game that collided.
+//
+
+// One vector register's worth of games. Vectors wider than the target's
+// registers are lowered element by element, which is slower than no vectors.
+#if defined(__AVX512F__)
+#define BATCH_LANES 16
+#elif defined(__AVX2__)
+#define BATCH_LANES 8
+#else
+#define BATCH_LANES 4
+#endif
+
+typedef unsigned int BatchLanes __attribute__((vector_size(BATCH_LANES*sizeof(unsigned int))));
+
+typedef struct batch {
+    Vec    grid_dims;
+    size_t grid_stride;
+    size_t games_count;
+    // The last group may be padded with lanes that are stepped but whose
+    // games aren't reported
+    size_t groups_count;
+    size_t snake_grow_increment;
+
+    // `grid_stride` bytes per game
+    unsigned char* grids;
+
+    // `groups_count` vectors each
+    BatchLanes* snake_head_x;
+    BatchLanes* snake_head_y;
+    BatchLanes* snake_tail_x;
+    BatchLanes* snake_tail_y;
+    BatchLanes* snake_head_direction;
+    BatchLanes* snake_tail_direction;
+    BatchLanes* snake_grow_countdown;
+    // Cells taken by the snake, head and tail included
+    BatchLanes* snake_length;
+    BatchLanes* food_x;
+    BatchLanes* food_y;
+    BatchLanes* score;
+    BatchLanes* rng;
+} Batch;
+
+unsigned int batch_rand(Batch* batch, size_t game) {
+    unsigned int x = batch->rng[game/BATCH_LANES][game%BATCH_LANES];
+    x ^= x<<13;
+    x ^= x>>17;
+    x ^= x<<5;
+    batch->rng[game/BATCH_LANES][game%BATCH_LANES] = x;
+    return x;
+}
+
+unsigned char batch_snake_at(Batch* batch, size_t game, size_t x, size_t y) {
+    unsigned char* grid = batch->grids + game*batch->grid_stride;
+    size_t idx = y*batch->grid_dims.x + x;
+    return (grid[idx>>2] >> ((idx & 3)<<1)) & 3;
+}
+
+// The snake must not fill the grid, or this never returns
+void batch_place_food(Batch* batch, size_t game) {
+    size_t group = game/BATCH_LANES;
+    size_t lane  = game%BATCH_LANES;
+    size_t x, y;
+    do {
+        x = batch_rand(batch, game)%batch->grid_dims.x;
+        y = batch_rand(batch, game)%batch->grid_dims.y;
+    } while (batch_snake_at(batch, game, x, y));
+    batch->food_x[group][lane] = x;
+    batch->food_y[group][lane] = y;
+}
+
+// Starts a new game: an empty grid and a snake of length 1 in the middle,
+// heading right
+void batch_reset(Batch* batch, size_t game) {
+    size_t group = game/BATCH_LANES;
+    size_t lane  = game%BATCH_LANES;
+
+    unsigned char* grid = batch->grids + game*batch->grid_stride;
+    memset(grid, 0, batch->grid_stride);
+
+    size_t x = batch->grid_dims.x>>1;
+    size_t y = batch->grid_dims.y>>1;
+    batch->snake_head_x[group][lane] = x;
+    batch->snake_head_y[group][lane] = y;
+    batch->snake_tail_x[group][lane] = x;
+    batch->snake_tail_y[group][lane] = y;
+    batch->snake_head_direction[group][lane] = RIGHT;
+    batch->snake_tail_direction[group][lane] = RIGHT;
+    batch->snake_grow_countdown[group][lane] = batch->snake_grow_increment;
+    batch->snake_length[group][lane] = 1;
+    batch->score[group][lane] = 0;
+
+    size_t idx = y*batch->grid_dims.x + x;
+    grid[idx>>2] |= 2<<((idx & 3)<<1);
+
+    batch_place_food(batch, game);
+}
+
+// Returns NULL if out of memory, or if the grid has no room for food next to
+// a new snake
+Batch* batch_create(size_t games_count, Vec grid_dims, unsigned int seed) {
+    if (grid_dims.x*grid_dims.y < 2)
+        return NULL;
+
+    Batch* batch = calloc(1, sizeof(Batch));
+    if (!batch)
+        return NULL;
+
+    batch->grid_dims    = grid_dims;
+    // 4 cells per byte
+    batch->grid_stride  = (grid_dims.x*grid_dims.y + 3)>>2;
+    batch->groups_count = (games_count + BATCH_LANES - 1)/BATCH_LANES;
+    batch->games_count  = games_count;
+    size_t lanes_count  = batch->groups_count*BATCH_LANES;
+
+    // Same as the in-game update for a terminal showing this grid
+    size_t half_circumference = (grid_dims.x<<1) + grid_dims.y + 1;
+    batch->snake_grow_increment = half_circumference/30;
+    if (batch->snake_grow_increment == 0)
+        batch->snake_grow_increment = 1;
+
+    BatchLanes** fields[] = {
+        &batch->snake_head_x, &batch->snake_head_y,
+        &batch->snake_tail_x, &batch->snake_tail_y,
+        &batch->snake_head_direction, &batch->snake_tail_direction,
+        &batch->snake_grow_countdown,
+        &batch->snake_length,
+        &batch->food_x, &batch->food_y,
+        &batch->score,
+        &batch->rng,
+    };
+    size_t fields_count = sizeof(fields)/sizeof(fields[0]);
+
+    void* lanes;
+    batch->grids = malloc(lanes_count*batch->grid_stride);
+    if (!batch->grids || posix_memalign(&lanes, sizeof(BatchLanes),
+                                        fields_count*batch->groups_count*sizeof(BatchLanes))) {
+        free(batch->grids);
+        free(batch);
+        return NULL;
+    }
+    for (size_t i = 0; i < fields_count; ++i)
+        *fields[i] = (BatchLanes*) lanes + i*batch->groups_count;
+
+    for (size_t game = 0; game < lanes_count; ++game) {
+        // xorshift must not be seeded with 0
+        unsigned int game_seed = seed ^ (game*0x9E3779B9u);
+        batch->rng[game/BATCH_LANES][game%BATCH_LANES] = game_seed ? game_seed : 1;
+        batch_reset(batch, game);
+    }
+
+    return batch;
+}
+
+void batch_destroy(Batch* batch) {
+    // All fields share the allocation of the first one
+    free(batch->snake_head_x);
+    free(batch->grids);
+    free(batch);
+}
+
+// Wraps coordinates that stepped one past either edge of [0, n)
+void batch_lanes_wrap(BatchLanes* v, unsigned int n) {
+    BatchLanes over  = (BatchLanes) (*v == n);
+    BatchLanes under = (BatchLanes) (*v == ~0u);
+    *v &= ~over;
+    *v  = (*v & ~under) | ((n - 1) & under);
+}
+
+// Advances every game by one tick. `actions` holds a Direction per game, or
+// -1 to keep going. `rewards` receives +1 for eating and -1 for dying, `dones`
+// is set for games that died or filled the grid, and were reset.
+void batch_step(Batch* batch, int* actions, float* rewards, unsigned char* dones) {
+    unsigned int grid_dims_x          = batch->grid_dims.x;
+    unsigned int grid_dims_y          = batch->grid_dims.y;
+    unsigned int snake_grow_increment = batch->snake_grow_increment;
+    unsigned int cells_count          = grid_dims_x*grid_dims_y;
+
+    for (size_t group = 0; group < batch->groups_count; ++group) {
+        size_t first_game = group*BATCH_LANES;
+
+        // The caller's buffers end within a padded last group, so that one
+        // goes through our own
+        int*           group_actions = actions + first_game;
+        float*         group_rewards = rewards + first_game;
+        unsigned char* group_dones   = dones   + first_game;
+        int            padded_actions[BATCH_LANES];
+        float          padded_rewards[BATCH_LANES];
+        unsigned char  padded_dones  [BATCH_LANES];
+        size_t         games_in_group = batch->games_count - first_game;
+        if (games_in_group < BATCH_LANES) {
+            for (size_t lane = 0; lane < BATCH_LANES; ++lane)
+                padded_actions[lane] = lane < games_in_group ? group_actions[lane] : -1;
+            group_actions = padded_actions;
+            group_rewards = padded_rewards;
+            group_dones   = padded_dones;
+        }
+
+        BatchLanes action;
+        memcpy(&action, group_actions, sizeof(action));
+
+        BatchLanes head_x         = batch->snake_head_x[group];
+        BatchLanes head_y         = batch->snake_head_y[group];
+        BatchLanes prev_direction = batch->snake_head_direction[group];
+
+        // -1 is out of range as unsigned
+        BatchLanes has_action = (BatchLanes) (action < 4);
+        BatchLanes direction  = (action & has_action) | (prev_direction & ~has_action);
+
+        BatchLanes direction_change_encoding = (direction - prev_direction + 2) & 3;
+        BatchLanes prev_head_idx = head_y*grid_dims_x + head_x;
+
+        // Comparisons are -1 where true
+        head_x += (BatchLanes) (direction == LEFT) - (BatchLanes) (direction == RIGHT);
+        head_y += (BatchLanes) (direction == UP  ) - (BatchLanes) (direction == DOWN );
+        batch_lanes_wrap(&head_x, grid_dims_x);
+        batch_lanes_wrap(&head_y, grid_dims_y);
+        BatchLanes head_idx = head_y*grid_dims_x + head_x;
+
+        BatchLanes eat = (BatchLanes) (head_x == batch->food_x[group])
+                       & (BatchLanes) (head_y == batch->food_y[group]);
+
+        BatchLanes countdown = batch->snake_grow_countdown[group]
+                             + (snake_grow_increment & eat);
+        BatchLanes retract   = (BatchLanes) (countdown == 0);
+        countdown += (BatchLanes) (countdown != 0);
+
+        BatchLanes tail_x   = batch->snake_tail_x[group];
+        BatchLanes tail_y   = batch->snake_tail_y[group];
+        BatchLanes tail_idx = tail_y*grid_dims_x + tail_x;
+
+        // The grid is accessed per lane. Operands go through plain arrays,
+        // as inserting single elements into a vector stalls on the
+        // following vector load.
+        unsigned int lanes_in [5][BATCH_LANES];
+        unsigned int lanes_out[2][BATCH_LANES];
+        memcpy(lanes_in[0], &prev_head_idx            , sizeof(BatchLanes));
+        memcpy(lanes_in[1], &direction_change_encoding, sizeof(BatchLanes));
+        memcpy(lanes_in[2], &head_idx                 , sizeof(BatchLanes));
+        memcpy(lanes_in[3], &tail_idx                 , sizeof(BatchLanes));
+        memcpy(lanes_in[4], &retract                  , sizeof(BatchLanes));
+
+        unsigned char* grid = batch->grids + first_game*batch->grid_stride;
+        for (size_t lane = 0; lane < BATCH_LANES; ++lane, grid += batch->grid_stride) {
+            // See `snake_extend_head`. The new head is marked even on a
+            // collision, the game is reset below anyway.
+            size_t idx = lanes_in[0][lane];
+            grid[idx>>2] = lanes_in[1][lane]<<((idx & 3)<<1)
+                               | (grid[idx>>2] & ~(3<<((idx & 3)<<1)));
+
+            idx = lanes_in[2][lane];
+            lanes_out[0][lane] = (grid[idx>>2] >> ((idx & 3)<<1)) & 3;
+            grid[idx>>2] |= 2<<((idx & 3)<<1);
+
+            // See `snake_retract_tail`, only clearing the cell in lanes
+            // that retract
+            idx = lanes_in[3][lane];
+            lanes_out[1][lane] = (grid[idx>>2] >> ((idx & 3)<<1)) & 3;
+            grid[idx>>2] &= ~((3 & lanes_in[4][lane])<<((idx & 3)<<1));
+        }
+
+        BatchLanes collided;
+        BatchLanes tail_direction_change_encoding;
+        memcpy(&collided                      , lanes_out[0], sizeof(BatchLanes));
+        memcpy(&tail_direction_change_encoding, lanes_out[1], sizeof(BatchLanes));
+        collided = (BatchLanes) (collided != 0);
+
+        BatchLanes tail_direction = batch->snake_tail_direction[group];
+        tail_direction = (((tail_direction + tail_direction_change_encoding + 2) & 3) & retract)
+                       | (tail_direction & ~retract);
+        BatchLanes tail_right = (BatchLanes) (tail_direction == RIGHT) & retract;
+        BatchLanes tail_left  = (BatchLanes) (tail_direction == LEFT ) & retract;
+        BatchLanes tail_down  = (BatchLanes) (tail_direction == DOWN ) & retract;
+        BatchLanes tail_up    = (BatchLanes) (tail_direction == UP   ) & retract;
+        tail_x += tail_left - tail_right;
+        tail_y += tail_up   - tail_down;
+        batch_lanes_wrap(&tail_x, grid_dims_x);
+        batch_lanes_wrap(&tail_y, grid_dims_y);
+
+        batch->snake_head_x[group]         = head_x;
+        batch->snake_head_y[group]         = head_y;
+        batch->snake_head_direction[group] = direction;
+        batch->snake_tail_x[group]         = tail_x;
+        batch->snake_tail_y[group]         = tail_y;
+        batch->snake_tail_direction[group] = tail_direction;
+        batch->snake_grow_countdown[group] = countdown;
+        // One cell longer, unless the tail retracted
+        batch->snake_length[group]        += 1 + retract;
+        batch->score[group]               -= eat & ~collided;
+
+        memset(group_rewards, 0, BATCH_LANES*sizeof(*group_rewards));
+        memset(group_dones  , 0, BATCH_LANES*sizeof(*group_dones  ));
+
+        // Rare, so handled per game
+        BatchLanes events = eat | collided;
+        unsigned int any_events = 0;
+        for (size_t lane = 0; lane < BATCH_LANES; ++lane)
+            any_events |= events[lane];
+        if (any_events) {
+            for (size_t lane = 0; lane < BATCH_LANES; ++lane) {
+                size_t game = first_game + lane;
+                if (!events[lane])
+                    continue;
+
+                if (collided[lane]) {
+                    group_rewards[lane] = -1;
+                    group_dones  [lane] = 1;
+                    batch_reset(batch, game);
+                } else if (batch->snake_length[group][lane] == cells_count) {
+                    group_rewards[lane] = 1;
+                    group_dones  [lane] = 1;
+                    batch_reset(batch, game);
+                } else {
+                    group_rewards[lane] = 1;
+                    batch_place_food(batch, game);
+                }
+            }
+        }
+
+        if (games_in_group < BATCH_LANES) {
+            memcpy(rewards + first_game, padded_rewards, games_in_group*sizeof(*rewards));
+            memcpy(dones   + first_game, padded_dones  , games_in_group*sizeof(*dones  ));
+        }
+    }
+}
+
+//
+// Environment API
+//
+// A C ABI over the batched engine for training harnesses, exported by the
+// library build (libsnake.so, see snake_env.h). Observations are written
+// straight into the caller's buffer: per game, three planes of
+// width*height bytes, each 0 or 1 in row-major order:
+//
+//     [game][SNAKE_ENV_PLANE_OCCUPANCY][y][x]  snake body, including head
+//     [game][SNAKE_ENV_PLANE_HEAD     ][y][x]
+//     [game][SNAKE_ENV_PLANE_FOOD     ][y][x]
+//
+// Games that are done have been reset, their observation is of the new game.
+// Nothing is allocated after `snake_env_create`.
+//
+
+// Unpacks a 2-bit grid into one byte per cell, 1 where the cell is not
+// empty. Eight cells at a time: the two bits of each cell are spread into
+// their own byte, then OR'd together. Assumes a little-endian target.
+void unpack_occupancy(unsigned char* grid, size_t cells_count, unsigned char* plane) {
+    size_t i = 0;
+    for (; i + 8 <= cells_count; i += 8) {
+        unsigned long long packed = grid[i>>2] | (unsigned long long) grid[(i>>2) + 1]<<32;
+        unsigned long long spread = packed | packed<<6 | packed<<12 | packed<<18;
+        spread &= 0x0303030303030303ull;
+        spread  = (spread | spread>>1) & 0x0101010101010101ull;
+        memcpy(plane + i, &spread, sizeof(spread));
+    }
+    for (; i < cells_count; ++i)
+        plane[i] = ((grid[i>>2] >> ((i & 3)<<1)) & 3) != 0;
+}
+
+LIB_EXPORT
+size_t snake_env_observation_size(SnakeEnv* env) {
+    return SNAKE_ENV_PLANES_COUNT*env->grid_dims.x*env->grid_dims.y;
+}
+
+LIB_EXPORT
+void snake_env_observe(SnakeEnv* env, unsigned char* observations) {
+    size_t cells_count = env->grid_dims.x*env->grid_dims.y;
+
+    for (size_t game = 0; game < env->games_count; ++game) {
+        size_t group = game/BATCH_LANES;
+        size_t lane  = game%BATCH_LANES;
+        unsigned char* observation = observations + game*SNAKE_ENV_PLANES_COUNT*cells_count;
+
+        unpack_occupancy(env->grids + game*env->grid_stride, cells_count,
+                         observation + SNAKE_ENV_PLANE_OCCUPANCY*cells_count);
+
+        unsigned char* head_plane = observation + SNAKE_ENV_PLANE_HEAD*cells_count;
+        unsigned char* food_plane = observation + SNAKE_ENV_PLANE_FOOD*cells_count;
+        memset(head_plane, 0, 2*cells_count);
+        head_plane[env->snake_head_y[group][lane]*env->grid_dims.x + env->snake_head_x[group][lane]] = 1;
+        food_plane[env->food_y      [group][lane]*env->grid_dims.x + env->food_x      [group][lane]] = 1;
+    }
+}
+
+// Returns NULL if out of memory or the grid is unusable, see snake_env.h
+LIB_EXPORT
+SnakeEnv* snake_env_create(size_t envs_count, size_t width, size_t height, unsigned int seed) {
+    // `batch_step` does coordinate and cell index arithmetic in 32-bit
+    // lanes, with one past either edge still representable
+    if (width == 0 || height == 0 || width > ((unsigned int) -1 - 1)/height)
+        return NULL;
+    return batch_create(envs_count, (Vec) {.x = width, .y = height}, seed);
+}
+
+LIB_EXPORT
+void snake_env_reset(SnakeEnv* env, unsigned char* observations) {
+    for (size_t game = 0; game < env->games_count; ++game)
+        batch_reset(env, game);
+    if (observations)
+        snake_env_observe(env, observations);
+}
+
+// `observations` may be NULL to skip observing
+LIB_EXPORT
+void snake_env_step(SnakeEnv* env, int* actions, float* rewards, unsigned char* dones,
+                    unsigned char* observations) {
+    batch_step(env, actions, rewards, dones);
+    if (observations)
+        snake_env_observe(env, observations);
+}
+
+LIB_EXPORT
+void snake_env_close(SnakeEnv* env) {
+    batch_destroy(env);
+}
+
+#endif // BATCH
+
+#if defined(TEST) || defined(BENCH)
+
+// Number of grid cells whose rendering on the emulated screen disagrees with
+// the grid state. Text drawn over empty cells, e.g. the controls hint, is
+// accepted as long as it doesn't look like snake or food.
+size_t vt_count_grid_mismatches(Vt* vt, State* state) {
+    const unsigned int SNAKE = 0x2588; // █
+    const unsigned int FOOD  = 0x2593; // ▓
+    const unsigned int WALL  = 0x2592; // ▒
+
+    size_t mismatches = 0;
+    for (size_t y = 0; y < state->grid_dims.y; ++y) {
+        for (size_t x = 0; x < state->grid_dims.x; ++x) {
+            Vec pos = {.x = x, .y = y};
+            unsigned int left  = vt_at(vt, x*2 + state->grid_offset.x    , y + state->grid_offset.y);
+            unsigned int right = vt_at(vt, x*2 + state->grid_offset.x + 1, y + state->grid_offset.y);
+
+            if (state->level && level_wall_at(state->level, pos)) {
+                mismatches += left != WALL  || right != WALL;
+            } else if (snake_at(state, pos)) {
+                mismatches += left != SNAKE || right != SNAKE;
+            } else if (x == state->food.x && y == state->food.y) {
+                mismatches += left != FOOD  || right != FOOD;
+            } else {
+                mismatches += left  == SNAKE || left  == FOOD || left  == WALL
+                           || right == SNAKE || right == FOOD || right == WALL;
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+#endif // TEST or BENCH
+
+float game_update(State* state) {
+    if (state->do_in_game_update) {
+        state->snake_head_prev_direction = state->snake_head_direction;
+        int input = capture_input(state);
+        if (input == QUIT) {
+#ifndef WASM
+            state->do_in_game_update = 0;
+            state->out_of_game_task = TEARDOWN;
+            return state->update_interval;
+#endif
+        } else if (input != -1 && input <= LEFT) {
+            state->snake_head_direction = input;
+        }
+
+        size_t extended = snake_extend_head(state);
+        size_t ate = state->snake_head.x == state->food.x && state->snake_head.y == state->food.y;
+        // Also over once the snake fills the board, with nowhere left for
+        // food, e.g. on a small level
+        if (!extended || (ate && !grid_has_room(state))) {
+#ifndef WASM
+            // Leave the snake as it was after the last tick, for rewinding
+            if (state->journal) {
+                if (extended)
+                    grid_set(state, state->snake_head, 0);
+                snake_withdraw_head(state);
+            }
+#endif
+            state->do_in_game_update = 0;
+            state->out_of_game_task = END_SCREEN;
+            return state->update_interval;
+        }
+
+        terminal_move_cursor_to_grid_pos(state, state->snake_head);
+        terminal_write(state, "██");
+
+        if (ate) {
+            state->snake_grow_countdown += state->snake_grow_increment;
+
+            ++state->score;
+
+            do {
+                state->food.x = rand()%state->grid_dims.x;
+                state->food.y = rand()%state->grid_dims.y;
+            } while (snake_at(state, state->food));
+            terminal_move_cursor_to_grid_pos(state, state->food);
+            terminal_write(state, "▓▓");
+
+            terminal_move_cursor(state, state->score_pos.x, state->score_pos.y);
+            terminal_write_int(state, state->score);
+        }
+
+#ifndef WASM
+        int tail_cell = -1;
+#endif
+        if (state->snake_grow_countdown == 0) {
+            terminal_move_cursor_to_grid_pos(state, state->snake_tail);
+            terminal_write(state, "  ");
+
+#ifndef WASM
+            tail_cell = snake_at(state, state->snake_tail);
+#endif
+            snake_retract_tail(state);
+        } else {
+            --state->snake_grow_countdown;
+        }
+
+#ifndef WASM
+        if (state->journal)
+            journal_record(state, state->snake_head_direction, ate, tail_cell);
+#endif
+        terminal_flush_out(state);
+    } else {
+        switch (state->out_of_game_task) {
+            case SETUP: {
+#ifndef WASM
+                fcntl(state->terminal_in_fd, F_SETFL, O_NONBLOCK);
+
+                struct termios new_terminal_config;
+                tcgetattr(state->terminal_in_fd, &state->orig_terminal_config);
+                new_terminal_config = state->orig_terminal_config;
+                {
+                    // Don't ignore carriage return or do mapping betwen carriage return
+                    // and newline
+                    new_terminal_config.c_iflag &= ~(IGNCR | ICRNL | INLCR);
+                    // Don't strip input characters to 7 bits
+                    new_terminal_config.c_iflag &= ~ISTRIP;
+                    // Disable parity checking and errors
+                    new_terminal_config.c_iflag &= ~(INPCK | PARMRK);
+                    // Don't do output processing
+                    new_terminal_config.c_oflag &= ~OPOST;
+                    // Disable echoing of input character back to output
+                    new_terminal_config.c_lflag &= ~(ECHO | ECHOE | ECHONL);
+                    // Enable "canonical" mode, disabling input buffering
+                    new_terminal_config.c_lflag &= ~ICANON;
+                    // See General Terminal Interface, POSIX, IEEE Std 1003.1-2024,
+                    // https://pubs.opengroup.org/onlinepubs/9799919799/basedefs/V1_chap11.html
+                    // for more info.
+                }
+                tcsetattr(state->terminal_in_fd, TCSANOW, &new_terminal_config);
+#endif
+            }; /* FALLTHROUGH! */
+            case RESET: {
+                state->terminal_dims = get_terminal_dims(state);
+
+                state->grid_offset.x = 0;
+                state->grid_offset.y = 1;
+                state->grid_dims.x = (state->terminal_dims.x - state->grid_offset.x)>>1;
+                state->grid_dims.y = (state->terminal_dims.y - state->grid_offset.y);
+#ifndef WASM
+                // A level that no longer fits the terminal is dropped
+                if (state->level && (state->level->width  > state->grid_dims.x
+                                  || state->level->height > state->grid_dims.y)) {
+                    level_close(state->level);
+                    state->level = NULL;
+                }
+                // Centered, cells are 2 columns wide
+                if (state->level) {
+                    state->grid_offset.x += state->grid_dims.x - state->level->width;
+                    state->grid_offset.y += (state->grid_dims.y - state->level->height)>>1;
+                    state->grid_dims.x    = state->level->width;
+                    state->grid_dims.y    = state->level->height;
+                }
+#endif
+                // 4 cells per byte
+                size_t grid_size = (state->grid_dims.x*state->grid_dims.y + 3)>>2;
+                // Kept after the last game if it was to be rewound
+                if (state->grid)
+                    grid_free(state);
+                grid_alloc(state, grid_size);
+#ifndef WASM
+                if (state->level)
+                    level_fill_grid(state->level, state->grid);
+                else
+#endif
+                for (size_t i = 0; i < grid_size; ++i) {
+                    state->grid[i] = 0;
+                }
+
+#ifndef WASM
+                if (state->journal)
+                    journal_clear(state->journal);
+                terminal_hide_cursor(state);
+#endif
+                terminal_clear(state);
+
+                Direction spawn_direction = RIGHT;
+                state->snake_head.x = (state->grid_dims.x>>1) - 5;
+                state->snake_head.y =  state->grid_dims.y>>1;
+#ifndef WASM
+                if (state->level) {
+                    LevelSpawn* spawn = &state->level->spawns[rand()%state->level->spawns_count];
+                    state->snake_head.x = spawn->x;
+                    state->snake_head.y = spawn->y;
+                    spawn_direction     = spawn->direction;
+                }
+#endif
+                state->snake_tail = state->snake_head;
+                state->snake_head_prev_direction = spawn_direction;
+                state->snake_head_direction      = spawn_direction;
+                state->snake_tail_direction      = spawn_direction;
+
+                snake_start(state, state->snake_head);
+                terminal_move_cursor_to_grid_pos(state, state->snake_head);
+                terminal_write(state, "██");
+#ifndef WASM
+                // Walls may be in the way of the controls, so they go on
+                // the score's row
+                if (state->level) {
+                    terminal_draw_walls(state);
+                    terminal_move_cursor(state, 16, 0);
+                }
+#endif
+                terminal_write(state, "            move with wasd/hjkl");
+#ifndef WASM
+                terminal_write(state, "; q to quit");
+#endif
+
+                size_t half_circumference = state->terminal_dims.x + state->terminal_dims.y;
+
+                state->snake_grow_increment = half_circumference/30;
+                if (state->snake_grow_increment == 0)
+                    state->snake_grow_increment = 1;
+                state->snake_grow_countdown = state->snake_grow_increment;
+
+                state->update_interval = ((float) 10)/((float) half_circumference);
 
                 do {
-                    state.food.x = rand()%state.grid_dims.x;
-                    state.food.y = rand()%state.grid_dims.y;
-                } while (snake_at(&state, state.food));
-                terminal_move_cursor_to_grid_pos(&state, state.food);
-                terminal_write(&state, "▓▓");
+                    state->food.x = rand()%state->grid_dims.x;
+                    state->food.y = rand()%state->grid_dims.y;
+                } while (snake_at(state, state->food));
+                terminal_move_cursor_to_grid_pos(state, state->food);
+                terminal_write(state, "▓▓");
 
-                state.score = 0;
+                state->score = 0;
 
-                terminal_move_cursor(&state, 0, 0);
-                terminal_write(&state, "Score: ");
-                terminal_write_int(&state, state.score);
+                terminal_move_cursor(state, 0, 0);
+                terminal_write(state, "Score: ");
+                terminal_write_int(state, state->score);
 
-                state.score_pos.x = 7;
-                state.score_pos.y = 0;
+                state->score_pos.x = 7;
+                state->score_pos.y = 0;
 
-                terminal_flush_out(&state);
+                terminal_flush_out(state);
 
-                state.do_in_game_update = 1;
+                state->do_in_game_update = 1;
             }; break;
             case END_SCREEN: {
-                size_t x = (state.terminal_dims.x>>1) - 8;
-                size_t y = (state.terminal_dims.y>>1) - 3;
-                terminal_move_cursor(&state, x, y);
-                terminal_write(&state, "   GAME OVER!   ");
-                terminal_move_cursor(&state, x, ++y);
-                terminal_write(&state, "                ");
-                terminal_move_cursor(&state, x, ++y);
-                terminal_write(&state, " Final Score: ");
-                terminal_write_int(&state, state.score);
-                terminal_write(&state, " ");
-                terminal_move_cursor(&state, x, ++y);
-                terminal_write(&state, "                ");
-                terminal_move_cursor(&state, x, ++y);
-                terminal_write(&state, "    r=replay    ");
-#ifndef WASM
-                terminal_move_cursor(&state, x, ++y);
-                terminal_write(&state, "    q=quit      ");
-#endif
-                terminal_flush_out(&state);
-
-                state.out_of_game_task = WAIT_FOR_REPLAY_OR_QUIT_INPUT;
-                brk(state.grid);
-                state.update_interval = 0.001;
+#ifndef WASM
+                if (state->high_scores)
+                    high_scores_submit(state->high_scores, state->score, time(NULL));
+#endif
+                // Set first, so that a redraw on flushing repeats the end
+                // screen
+                state->out_of_game_task = WAIT_FOR_REPLAY_OR_QUIT_INPUT;
+                terminal_draw_end_screen(state);
+                terminal_flush_out(state);
+
+#ifndef WASM
+                if (!state->journal)
+#endif
+                grid_free(state);
+                state->update_interval = UPDATE_ON_INPUT;
             }; break;
             case WAIT_FOR_REPLAY_OR_QUIT_INPUT: {
-                switch (capture_input()) {
-                    case REPLAY: state.out_of_game_task = RESET   ; break;
+                int input = capture_input(state);
+                switch (input) {
+                    case REPLAY: state->out_of_game_task = RESET   ; break;
 #ifndef WASM
-                    case QUIT  : state.out_of_game_task = TEARDOWN; break;
+                    case QUIT  : state->out_of_game_task = TEARDOWN; break;
+                    case REWIND: case FORWARD: {
+                        if (state->journal) {
+                            if (input == REWIND)
+                                journal_step_back(state);
+                            else
+                                journal_step_forward(state);
+
+                            Journal* journal = state->journal;
+                            terminal_draw_game(state);
+                            // Next to the score, leaving room for its digits
+                            terminal_move_cursor(state, state->score_pos.x + 8, state->score_pos.y);
+                            terminal_write(state, "tick ");
+                            terminal_write_int(state, journal->now);
+                            terminal_write(state, " of ");
+                            terminal_write_int(state, journal->last);
+                            terminal_write(state, ", [ ]=step r=replay q=quit");
+                            terminal_flush_out(state);
+                        }
+                    }; return state->update_interval;
 #endif
+                    default: return state->update_interval;
                 }
+                state->update_interval = 0;
             }; break;
             case TEARDOWN: {
-                brk(state.grid);
+                grid_free(state);
 #ifndef WASM
-                terminal_move_cursor(&state, state.terminal_dims.x-1,
-                                             state.terminal_dims.y-1);
-                terminal_restore_cursor(&state);
-                terminal_flush_out(&state);
+                terminal_move_cursor(state, state->terminal_dims.x-1,
+                                            state->terminal_dims.y-1);
+                terminal_restore_cursor(state);
+                terminal_flush_out(state);
 
-                tcsetattr(STDIN_FILENO, TCSANOW, &state.orig_terminal_config);
+                tcsetattr(state->terminal_in_fd, TCSANOW, &state->orig_terminal_config);
 #endif
             }; break;
         }
     }
 
-    return state.update_interval;
+    return state->update_interval;
 }
 
-#ifndef TEST
+State state;
+
+#ifdef WASM
+__attribute__((export_name("update")))
+#endif
+float update(void) {
+    return game_update(&state);
+}
+
+#ifndef WASM
+
+//
+// Tick timing
+//
+// Ticks are timed against absolute deadlines in integer nanoseconds of
+// CLOCK_MONOTONIC, so they don't drift. Waking up from a sleep is late by
+// tens of microseconds, more on a loaded host, which shows as stutter.
+//
+// Realtime mode, enabled with SNAKE_REALTIME, trades some CPU time for
+// regular ticks. It sleeps until shortly before a deadline and spins the
+// rest of the way. How early it wakes adapts to how late wakeups have been,
+// twice the worst recent one, between REALTIME_SPIN_MIN_NS and
+// REALTIME_SPIN_MAX_NS, which bounds the CPU time spent.
+//
+// It also asks for SCHED_FIFO, locks all memory against page faults, and
+// pins the game thread to the CPU given in SNAKE_REALTIME if that is a
+// number. The scheduling and locking need privileges (CAP_SYS_NICE and
+// CAP_IPC_LOCK, or a big enough RLIMIT_MEMLOCK), and the mode does without
+// whatever it isn't allowed. Timing stats are printed on exit.
+//
+
+#define REALTIME_SPIN_MIN_NS     50000
+#define REALTIME_SPIN_MAX_NS   2000000
+#define REALTIME_FIFO_PRIORITY      10
+
+typedef struct tick_clock {
+    // Nanoseconds, CLOCK_MONOTONIC
+    unsigned long long deadline;
+
+    int                realtime;
+    unsigned long long realtime_spin;
+    int                realtime_cpu; // -1 if not pinned
+    int                realtime_fifo;
+    int                realtime_locked;
+
+    // Lateness of wakeups from timed waits, and jitter, its change from one
+    // tick to the next, in nanoseconds
+    size_t             ticks;
+    unsigned long long late_last;
+    unsigned long long late_sum;
+    unsigned long long late_max;
+    unsigned long long jitter_sum;
+    unsigned long long jitter_max;
+} TickClock;
+
+unsigned long long clock_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+// Only affects the calling thread, apart from locking memory
+void tick_clock_realtime(TickClock* clock, char* cpu) {
+    clock->realtime     = 1;
+    clock->realtime_cpu = -1;
+
+    char* cpu_end;
+    long  cpu_index = strtol(cpu, &cpu_end, 10);
+    if (*cpu != '\0' && *cpu_end == '\0' && cpu_index >= 0 && cpu_index < CPU_SETSIZE) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_index, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0)
+            clock->realtime_cpu = cpu_index;
+    }
+
+    struct sched_param param = {.sched_priority = REALTIME_FIFO_PRIORITY};
+    clock->realtime_fifo   = sched_setscheduler(0, SCHED_FIFO, &param) == 0;
+    clock->realtime_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+
+    // Otherwise the kernel may defer our wakeups by 50us to batch them with
+    // others. SCHED_FIFO threads get no slack anyway.
+    prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+}
+
+void tick_clock_report(TickClock* clock, FILE* out) {
+    double ticks = clock->ticks ? clock->ticks : 1;
+
+    fprintf(out, "%zu ticks, late by %.1f us avg, %.1f us max, jitter %.1f us avg, %.1f us max",
+            clock->ticks,
+            clock->late_sum*1e-3/ticks  , clock->late_max*1e-3,
+            clock->jitter_sum*1e-3/ticks, clock->jitter_max*1e-3);
+    if (clock->realtime) {
+        fprintf(out, " (spin %lluus, %s, %s",
+                clock->realtime_spin/1000,
+                clock->realtime_fifo   ? "SCHED_FIFO" : "no SCHED_FIFO",
+                clock->realtime_locked ? "memory locked" : "memory not locked");
+        if (clock->realtime_cpu != -1)
+            fprintf(out, ", cpu %d", clock->realtime_cpu);
+        fprintf(out, ")");
+    }
+    fprintf(out, "\n");
+}
+
+// Sleeps until the next update is due, or blocks until there is input if
+// the last update asked for that
+void wait_for_update(State* state, float update_interval, TickClock* clock) {
+    if (update_interval == UPDATE_ON_INPUT) {
+        struct pollfd input_pollfd = {.fd = state->terminal_in_fd, .events = POLLIN};
+
+        // The last frame may not have fit in the writer's ring, so keep
+        // offering it until it does
+        while (state->terminal_out_len > 0 && poll(&input_pollfd, 1, 10) == 0)
+            terminal_flush_out(state);
+        // Hangups and errors end the wait as well, `capture_input` then
+        // takes them for QUIT
+        poll(&input_pollfd, 1, -1);
+
+        // Don't try to catch up on the time spent waiting
+        clock->deadline = clock_now_ns();
+        return;
+    }
+
+    clock->deadline += (unsigned long long) (update_interval*1e9 + 0.5);
+
+    unsigned long long wake = clock->deadline;
+    if (clock->realtime) {
+        if (clock->realtime_spin < REALTIME_SPIN_MIN_NS)
+            clock->realtime_spin = REALTIME_SPIN_MIN_NS;
+        wake = wake > clock->realtime_spin ? wake - clock->realtime_spin : 0;
+    }
+    struct timespec wake_ts = {.tv_sec = wake/1000000000, .tv_nsec = wake%1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_ts, NULL) == EINTR);
+
+    unsigned long long now = clock_now_ns();
+    if (clock->realtime) {
+        unsigned long long overshoot = now > wake ? now - wake : 0;
+        if (overshoot*2 > clock->realtime_spin)
+            clock->realtime_spin = overshoot*2 < REALTIME_SPIN_MAX_NS ? overshoot*2 : REALTIME_SPIN_MAX_NS;
+        else
+            clock->realtime_spin -= clock->realtime_spin/64;
+
+        while (now < clock->deadline)
+            now = clock_now_ns();
+    }
+
+    unsigned long long late   = now > clock->deadline ? now - clock->deadline : 0;
+    unsigned long long jitter = late > clock->late_last ? late - clock->late_last
+                                                        : clock->late_last - late;
+    if (clock->ticks == 0)
+        jitter = 0;
+    ++clock->ticks;
+    clock->late_last   = late;
+    clock->late_sum   += late;
+    clock->jitter_sum += jitter;
+    if (late > clock->late_max)
+        clock->late_max = late;
+    if (jitter > clock->jitter_max)
+        clock->jitter_max = jitter;
+}
+
+#endif // not WASM
+
+#if defined(TEST) || defined(SERVER)
+
+//
+// Timer wheel
+//
+// Hierarchical, with millisecond resolution: WHEEL_LEVELS levels of
+// WHEEL_SLOTS slots, level n spanning WHEEL_SLOTS^(n + 1) ms. A timer goes
+// into the lowest level whose span covers its delay and moves down a level
+// each time `now` enters its slot, so inserting, removing and expiring are
+// constant time however many timers there are. Timers are intrusive, the
+// server embeds one in each session.
+//
+
+#define WHEEL_LEVELS    3
+#define WHEEL_SLOT_BITS 8
+#define WHEEL_SLOTS     (1<<WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+
+typedef struct wheel_timer {
+    unsigned long long   deadline;
+    struct wheel_timer*  next;
+    struct wheel_timer*  prev;
+    // NULL while not on the wheel
+    struct wheel_timer** slot;
+} WheelTimer;
+
+typedef struct timer_wheel {
+    unsigned long long now;
+    WheelTimer*        slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+// `timer->deadline` must not be in the past
+void wheel_insert(TimerWheel* wheel, WheelTimer* timer) {
+    unsigned long long deadline = timer->deadline;
+
+    // Pick the lowest level whose span covers the delay; anything beyond the
+    // top level's span waits in its last slot and is cascaded again
+    unsigned long long delta = deadline - wheel->now;
+    size_t level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ull<<((level + 1)*WHEEL_SLOT_BITS))
+        ++level;
+    if (delta >= 1ull<<(WHEEL_LEVELS*WHEEL_SLOT_BITS))
+        deadline = wheel->now + (1ull<<(WHEEL_LEVELS*WHEEL_SLOT_BITS)) - 1;
+
+    WheelTimer** slot = &wheel->slots[level][(deadline>>(level*WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot = timer;
+}
+
+void wheel_remove(WheelTimer* timer) {
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->slot = NULL;
+}
+
+// Re-inserts everything in the slot of `level` that `now` just entered
+void wheel_cascade(TimerWheel* wheel, size_t level) {
+    WheelTimer** slot = &wheel->slots[level][(wheel->now>>(level*WHEEL_SLOT_BITS)) & WHEEL_SLOT_MASK];
+    WheelTimer*  timer = *slot;
+    *slot = NULL;
+    while (timer) {
+        WheelTimer* next = timer->next;
+        wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+// Milliseconds until the wheel needs to advance again, -1 if it is empty so
+// that sessions waiting for input cost no wakeups at all
+int wheel_timeout(TimerWheel* wheel) {
+    // Scan the rest of the lowest level, otherwise wake up for the next
+    // cascade
+    size_t now_slot = wheel->now & WHEEL_SLOT_MASK;
+    for (size_t slot = now_slot + 1; slot < WHEEL_SLOTS; ++slot) {
+        if (wheel->slots[0][slot])
+            return slot - now_slot;
+    }
+    for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+        for (size_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            if (wheel->slots[level][slot])
+                return WHEEL_SLOTS - now_slot;
+        }
+    }
+    return -1;
+}
+
+// When `now` next enters a slot with timers in it, to expire them or to
+// cascade them down, ~0 if the wheel is empty
+unsigned long long wheel_next_event(TimerWheel* wheel) {
+    unsigned long long next = ~0ull;
+    for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+        size_t             shift = level*WHEEL_SLOT_BITS;
+        unsigned long long index = wheel->now>>shift;
+        for (size_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            if (!wheel->slots[level][slot])
+                continue;
+            // The first index after the current one that lands on `slot`
+            unsigned long long entered = (index + ((slot - index - 1) & WHEEL_SLOT_MASK) + 1)<<shift;
+            if (entered < next)
+                next = entered;
+        }
+    }
+    return next;
+}
+
+// Advances the wheel towards `until` and takes off the next timer that is
+// due by then, NULL once there are none. Timers inserted for the current
+// millisecond while expiring are returned by the same run.
+WheelTimer* wheel_expire(TimerWheel* wheel, unsigned long long until) {
+    for (;;) {
+        WheelTimer* timer = wheel->slots[0][wheel->now & WHEEL_SLOT_MASK];
+        if (timer) {
+            wheel_remove(timer);
+            return timer;
+        }
+        if (wheel->now >= until)
+            return NULL;
+
+        // Straight to the next slot with timers, nothing happens on the way,
+        // so that catching up after a long idle time costs no more than a
+        // few steps
+        unsigned long long next = wheel_next_event(wheel);
+        if (next > until) {
+            wheel->now = until;
+            return NULL;
+        }
+
+        wheel->now = next;
+        for (size_t level = 1; level < WHEEL_LEVELS; ++level) {
+            if (wheel->now & ((1ull<<(level*WHEEL_SLOT_BITS)) - 1))
+                break;
+            wheel_cascade(wheel, level);
+        }
+    }
+}
+
+#endif // TEST or SERVER
+
+#if !defined(TEST) && !defined(BENCH) && !defined(SERVER) && !defined(LIB)
 //#if 0
 #ifndef WASM
-int main(void) {
-    float update_interval = update();
+int main(int argc, char** argv) {
+    if (argc == 4 && strcmp(argv[1], "--make-level") == 0) {
+        FILE* text = fopen(argv[2], "r");
+        int   made = text && level_make(text, argv[3]) == 0;
+        if (text)
+            fclose(text);
+        if (!made) {
+            fprintf(stderr, "snake: can't make a level from %s\n", argv[2]);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
 
-    struct timespec update_deadline;
-    clock_gettime(CLOCK_MONOTONIC, &update_deadline);
+    state.terminal_in_fd  = STDIN_FILENO;
+    state.terminal_out_fd = STDOUT_FILENO;
 
-    while (state.do_in_game_update || state.out_of_game_task != TEARDOWN) {
+    if (argc > 1) {
+        state.level = level_open(argv[1]);
+        if (!state.level) {
+            fprintf(stderr, "snake: %s is not a level\n", argv[1]);
+            return EXIT_FAILURE;
+        }
 
-        update_deadline.tv_nsec += update_interval*1e9;
-        while (update_deadline.tv_nsec >= 1e9) {
-            update_deadline.tv_sec  += 1;
-            update_deadline.tv_nsec -= 1e9;
+        Vec terminal_dims = get_terminal_dims(&state);
+        if (state.level->width > terminal_dims.x>>1 || state.level->height > terminal_dims.y - 1) {
+            fprintf(stderr, "snake: %s needs a %ux%u terminal\n", argv[1],
+                    state.level->width*2 + 1, state.level->height + 1);
+            return EXIT_FAILURE;
         }
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &update_deadline, NULL);
+    }
+    state.high_scores     = high_scores_open_default();
+    // Falls back to writing from the game thread
+    state.terminal_writer = terminal_writer_start(STDOUT_FILENO);
+    // The last 4096 ticks can be rewound from the end screen, ~20KB
+    state.journal         = journal_create(4096);
+
+    // After starting the writer, which shouldn't be pinned or SCHED_FIFO
+    TickClock clock = {0};
+    char* realtime_cpu = getenv("SNAKE_REALTIME");
+    if (realtime_cpu)
+        tick_clock_realtime(&clock, realtime_cpu);
 
+    float update_interval = update();
+
+    clock.deadline = clock_now_ns();
+
+    while (state.do_in_game_update || state.out_of_game_task != TEARDOWN) {
+        wait_for_update(&state, update_interval, &clock);
         update_interval = update();
     }
 
     update();
+
+    // Wait for everything that was handed over, then write what didn't fit
+    if (state.terminal_writer) {
+        terminal_writer_stop(state.terminal_writer);
+        state.terminal_writer = NULL;
+    }
+    terminal_flush_out(&state);
+
+    if (clock.realtime) {
+        fprintf(stderr, "snake: ");
+        tick_clock_report(&clock, stderr);
+    }
     return 0;
 }
 #endif
 
+#elif defined(SERVER)
+
+//
+// Multi-session game server
+//
+//     snake-server [port] [threads]
+//
+// Every TCP connection is a session with its own State and output buffer,
+// played with e.g. `stty raw -echo; nc localhost 7777; stty sane`. Each
+// thread runs its own event loop on its own SO_REUSEPORT listening socket,
+// so threads share nothing and the kernel spreads connections between them.
+// Sessions are sockets only, serving PTYs isn't implemented. A socket has no
+// window size, so every session plays on the fallback of an 80x24 terminal.
+//
+// Ticks of all sessions of a thread are scheduled on a hierarchical timer
+// wheel with millisecond resolution. epoll only wakes us for new connections
+// and hangups, input is picked up by `capture_input` on the session's next
+// tick like in the terminal build.
+//
+
+// Pending output beyond this means the client isn't reading, so we drop it
+// before the output buffer can overflow
+#define SESSION_MAX_PENDING_OUT 512
+
+typedef struct session {
+    // First, so that the wheel's timers are sessions
+    WheelTimer timer;
+    State      state;
+} Session;
+
+// When out of fds, accepting is retried this often at the latest, in case
+// fds were freed elsewhere in the process
+#define SERVER_ACCEPT_RETRY_MS 100
+
+HighScores* server_high_scores;
+
+// One per thread
+typedef struct server {
+    TimerWheel wheel;
+    int        epoll_fd;
+    int        listen_fd;
+    // While out of fds the listening socket is off epoll until
+    // `accept_retry`, see `server_accept`
+    int                accept_paused;
+    unsigned long long accept_retry;
+} Server;
+
+unsigned long long server_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+void server_accept_resume(Server* server) {
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &listen_event);
+    server->accept_paused = 0;
+}
+
+void server_session_close(Server* server, Session* session) {
+    if (session->timer.slot)
+        wheel_remove(&session->timer);
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, session->state.terminal_in_fd, NULL);
+    close(session->state.terminal_in_fd);
+    grid_free(&session->state);
+    terminal_out_free(&session->state);
+    free(session);
+
+    // There's an fd for a waiting connection now
+    if (server->accept_paused)
+        server_accept_resume(server);
+}
+
+void server_session_tick(Server* server, Session* session) {
+    State* state = &session->state;
+
+    float update_interval = game_update(state);
+
+    if (!state->do_in_game_update && state->out_of_game_task == TEARDOWN) {
+        game_update(state);
+        server_session_close(server, session);
+        return;
+    }
+    if (state->terminal_out_len > SESSION_MAX_PENDING_OUT) {
+        server_session_close(server, session);
+        return;
+    }
+
+    // Park the session off the wheel until epoll reports input
+    if (update_interval == UPDATE_ON_INPUT) {
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = session};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, state->terminal_in_fd, &event);
+        return;
+    }
+
+    // Deadlines are absolute so that ticks don't drift, but a session that
+    // fell behind doesn't try to catch up
+    TimerWheel* wheel = &server->wheel;
+    unsigned long long interval_ms = update_interval*1000 + 0.5;
+    session->timer.deadline += interval_ms;
+    if (session->timer.deadline <= wheel->now)
+        session->timer.deadline = wheel->now + 1;
+    wheel_insert(wheel, &session->timer);
+}
+
+void server_accept(Server* server) {
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Out of fds, so the connection stays in the backlog, which the
+            // level-triggered listening socket would report on every pass.
+            // Stop listening until a session closes or for a while.
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listen_fd, NULL);
+                server->accept_paused = 1;
+                server->accept_retry  = server_now_ms() + SERVER_ACCEPT_RETRY_MS;
+            }
+            // Otherwise EAGAIN, the backlog is empty
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Session* session = calloc(1, sizeof(Session));
+        if (!session) {
+            close(fd);
+            continue;
+        }
+        session->state.terminal_in_fd  = fd;
+        session->state.terminal_out_fd = fd;
+        session->state.high_scores     = server_high_scores;
+        session->timer.deadline = server->wheel.now;
+
+        struct epoll_event event = {.events = EPOLLRDHUP, .data.ptr = session};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+        // Runs SETUP and RESET right away
+        server_session_tick(server, session);
+    }
+}
+
+void* server_run(void* port_ptr) {
+    int port = *(int*) port_ptr;
+
+    Server* server = calloc(1, sizeof(Server));
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1
+            || listen(server->listen_fd, SOMAXCONN) == -1) {
+        perror("snake-server: listen");
+        exit(EXIT_FAILURE);
+    }
+
+    server->epoll_fd = epoll_create1(0);
+    server_accept_resume(server);
+
+    TimerWheel* wheel = &server->wheel;
+    wheel->now = server_now_ms();
+
+    struct epoll_event events[64];
+    for (;;) {
+        int timeout = wheel_timeout(wheel);
+        if (server->accept_paused) {
+            unsigned long long now = server_now_ms();
+            int retry = server->accept_retry > now ? server->accept_retry - now : 0;
+            if (timeout == -1 || retry < timeout)
+                timeout = retry;
+        }
+
+        int events_count = epoll_wait(server->epoll_fd, events, 64, timeout);
+        if (events_count == -1) {
+            // A signal, there may be timers due all the same
+            if (errno != EINTR) {
+                perror("snake-server: epoll_wait");
+                exit(EXIT_FAILURE);
+            }
+            events_count = 0;
+        }
+
+        for (int i = 0; i < events_count; ++i) {
+            Session* session = events[i].data.ptr;
+            if (!session) {
+                server_accept(server);
+            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                server_session_close(server, session);
+            } else {
+                // Input for a parked session, so go back to hangups only
+                struct epoll_event event = {.events = EPOLLRDHUP, .data.ptr = session};
+                epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, session->state.terminal_in_fd, &event);
+                session->timer.deadline = wheel->now;
+                server_session_tick(server, session);
+            }
+        }
+
+        unsigned long long now = server_now_ms();
+        if (server->accept_paused && now >= server->accept_retry) {
+            server_accept_resume(server);
+            server_accept(server);
+        }
+
+        WheelTimer* timer;
+        while ((timer = wheel_expire(wheel, now)))
+            server_session_tick(server, (Session*) timer);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int    port          = argc > 1 ? atoi(argv[1]) : 7777;
+    size_t threads_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    if (threads_count == 0)
+        threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Clients that hang up mid-write are handled by epoll
+    signal(SIGPIPE, SIG_IGN);
+
+    // Shared by all sessions of all threads
+    server_high_scores = high_scores_open_default();
+
+    printf("snake-server: port %d, %zu threads, %zu bytes per session + grid\n",
+           port, threads_count, sizeof(Session));
+    fflush(stdout);
+
+    for (size_t i = 1; i < threads_count; ++i) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, server_run, &port);
+    }
+    server_run(&port);
+
+    return 0;
+}
+
+#elif defined(LIB)
+
+// The library has no entry point, see the environment API
+
+#elif defined(BENCH)
+
+#include <sys/wait.h>
+
+//
+// Headless benchmark
+//
+// Plays games with a simple bot, feeding all output to the VT emulator, and
+// reports exact bytes and escape sequences per frame, plus the number of
+// frames whose rendering disagreed with the grid state.
+//
+
+// Turn towards the food if that is safe, otherwise keep going or take any
+// free direction
+char bench_bot_input(void) {
+    const char KEYS[4] = {'w', 'd', 's', 'a'};
+
+    Vec head = state.snake_head;
+    Direction current = state.snake_head_direction;
+    Direction preferred = current;
+    if      (state.food.x > head.x) preferred = RIGHT;
+    else if (state.food.x < head.x) preferred = LEFT;
+    else if (state.food.y > head.y) preferred = DOWN;
+    else if (state.food.y < head.y) preferred = UP;
+
+    Direction candidates[6] = {preferred, current, UP, RIGHT, DOWN, LEFT};
+    for (size_t i = 0; i < 6; ++i) {
+        Direction direction = candidates[i];
+        // Reversing onto our own neck is always fatal
+        if (direction == ((current + 2) & 3))
+            continue;
+        Vec next = head;
+        snake_step(&next, direction, state.grid_dims);
+        if (!snake_at(&state, next))
+            return KEYS[direction];
+    }
+
+    return KEYS[current];
+}
+
+// A game of the batch benchmark stepped with the single-game functions, the
+// way the in-game update does minus rendering
+void bench_single_reset(State* single, Vec grid_dims, size_t snake_grow_increment) {
+    size_t grid_size = (grid_dims.x*grid_dims.y + 3)>>2;
+    for (size_t i = 0; i < grid_size; ++i)
+        single->grid[i] = 0;
+    single->grid_dims = grid_dims;
+
+    single->snake_head.x = grid_dims.x>>1;
+    single->snake_head.y = grid_dims.y>>1;
+    single->snake_tail   = single->snake_head;
+    single->snake_head_direction = RIGHT;
+    single->snake_tail_direction = RIGHT;
+    single->snake_grow_increment = snake_grow_increment;
+    single->snake_grow_countdown = snake_grow_increment;
+    single->score = 0;
+    snake_start(single, single->snake_head);
+
+    do {
+        single->food.x = rand()%grid_dims.x;
+        single->food.y = rand()%grid_dims.y;
+    } while (snake_at(single, single->food));
+}
+
+void bench_single_step(State* single, int action) {
+    single->snake_head_prev_direction = single->snake_head_direction;
+    if (action != -1)
+        single->snake_head_direction = action;
+
+    if (!snake_extend_head(single)) {
+        bench_single_reset(single, single->grid_dims, single->snake_grow_increment);
+        return;
+    }
+
+    if (single->snake_head.x == single->food.x && single->snake_head.y == single->food.y) {
+        single->snake_grow_countdown += single->snake_grow_increment;
+        ++single->score;
+        do {
+            single->food.x = rand()%single->grid_dims.x;
+            single->food.y = rand()%single->grid_dims.y;
+        } while (snake_at(single, single->food));
+    }
+
+    if (single->snake_grow_countdown == 0)
+        snake_retract_tail(single);
+    else
+        --single->snake_grow_countdown;
+}
+
+double bench_seconds_since(struct timespec* t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec)*1e-9;
+}
+
+// Opening a level and filling a grid from it, for square levels of a few
+// sizes with random walls. Opening should take the same time for any size,
+// filling time in proportion to it.
+void bench_levels(void) {
+    char path[] = "/tmp/snake-bench-level-XXXXXX";
+    int  fd     = mkstemp(path);
+
+    for (unsigned int side = 1024; side <= 4096; side *= 2) {
+        Level header = {
+            .magic        = LEVEL_MAGIC,
+            .width        = side,
+            .height       = side,
+            .spawns_count = 1,
+        };
+        LevelSpawn spawn = {.x = 0, .y = 0, .direction = RIGHT};
+
+        size_t         walls_size = ((size_t) side*side + 7)/8;
+        unsigned char* walls      = malloc(walls_size);
+        for (size_t i = 0; i < walls_size; ++i)
+            walls[i] = rand();
+        walls[0] &= ~1;
+
+        ftruncate(fd, 0);
+        pwrite(fd, &header, sizeof(header), 0);
+        pwrite(fd, &spawn , sizeof(spawn) , sizeof(header));
+        pwrite(fd, walls  , walls_size    , sizeof(header) + sizeof(spawn));
+        free(walls);
+
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        Level* level = level_open(path);
+        double open_elapsed = bench_seconds_since(&t0);
+
+        unsigned char* grid = malloc(((size_t) side*side + 3)>>2);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        level_fill_grid(level, grid);
+        double fill_elapsed = bench_seconds_since(&t0);
+
+        printf("level %4ux%-4u open %.1f us, fill %.2f ms (%.2f ns/cell)\n",
+               side, side, open_elapsed*1e6, fill_elapsed*1e3,
+               fill_elapsed*1e9/((double) side*side));
+
+        free(grid);
+        level_close(level);
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+// Ticks per second of BENCH_BATCH_GAMES games stepped one by one and as a
+// batch, on an 80x24 terminal's grid with random turns
+#define BENCH_BATCH_GAMES 4096
+#define BENCH_BATCH_TICKS 500
+#define BENCH_BATCH_ACTIONS_TICKS 64
+
+void bench_batch(void) {
+    Vec grid_dims = {.x = 40, .y = 23};
+
+    static int actions[BENCH_BATCH_ACTIONS_TICKS][BENCH_BATCH_GAMES];
+    unsigned int x = 1;
+    for (size_t tick = 0; tick < BENCH_BATCH_ACTIONS_TICKS; ++tick) {
+        for (size_t game = 0; game < BENCH_BATCH_GAMES; ++game) {
+            x ^= x<<13;
+            x ^= x>>17;
+            x ^= x<<5;
+            // Turn left or right one tick in eight
+            actions[tick][game] = x%8 == 0 ? (int) ((x>>4) & 3) : -1;
+        }
+    }
+
+    Batch* batch = batch_create(BENCH_BATCH_GAMES, grid_dims, 1);
+
+    static State singles[BENCH_BATCH_GAMES];
+    unsigned char* single_grids = malloc(BENCH_BATCH_GAMES*batch->grid_stride);
+    for (size_t game = 0; game < BENCH_BATCH_GAMES; ++game) {
+        singles[game].grid = single_grids + game*batch->grid_stride;
+        bench_single_reset(singles + game, grid_dims, batch->snake_grow_increment);
+    }
+
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t tick = 0; tick < BENCH_BATCH_TICKS; ++tick) {
+        int* tick_actions = actions[tick%BENCH_BATCH_ACTIONS_TICKS];
+        for (size_t game = 0; game < BENCH_BATCH_GAMES; ++game) {
+            bench_single_step(singles + game, tick_actions[game]);
+        }
+    }
+    double single_ticks_per_s = BENCH_BATCH_TICKS*BENCH_BATCH_GAMES/bench_seconds_since(&t0);
+
+    static float         rewards[BENCH_BATCH_GAMES];
+    static unsigned char dones  [BENCH_BATCH_GAMES];
+    size_t               dones_count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t tick = 0; tick < BENCH_BATCH_TICKS; ++tick) {
+        batch_step(batch, actions[tick%BENCH_BATCH_ACTIONS_TICKS], rewards, dones);
+        dones_count += dones[0];
+    }
+    double batch_ticks_per_s = BENCH_BATCH_TICKS*BENCH_BATCH_GAMES/bench_seconds_since(&t0);
+
+    unsigned char* observations = malloc(BENCH_BATCH_GAMES*snake_env_observation_size(batch));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t tick = 0; tick < BENCH_BATCH_TICKS; ++tick)
+        snake_env_step(batch, actions[tick%BENCH_BATCH_ACTIONS_TICKS], rewards, dones, observations);
+    double env_ticks_per_s = BENCH_BATCH_TICKS*BENCH_BATCH_GAMES/bench_seconds_since(&t0);
+    free(observations);
+
+    printf("single game ticks/s   %.0f\n", single_ticks_per_s);
+    printf("batch ticks/s         %.0f (%.1fx, %d lanes)\n",
+           batch_ticks_per_s, batch_ticks_per_s/single_ticks_per_s, BATCH_LANES);
+    printf("env step+observe/s    %.0f (%zu byte observations)\n",
+           env_ticks_per_s, snake_env_observation_size(batch));
+
+    batch_destroy(batch);
+    free(single_grids);
+}
+
+int main(int argc, char** argv) {
+    size_t frames_target = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+
+    int input_pipe[2];
+    pipe(input_pipe);
+    fcntl(input_pipe[0], F_SETFL, O_NONBLOCK);
+
+    // Without a TTY `get_terminal_dims` falls back to an 80x24 terminal
+    static unsigned int vt_cells[80*24];
+    Vt vt;
+    vt_init(&vt, vt_cells, (Vec) {.x = 80, .y = 24});
+
+    state.terminal_in_fd   = input_pipe[0];
+    state.vt               = &vt;
+    state.out_of_game_task = RESET;
+
+    size_t frames            = 0;
+    size_t games             = 0;
+    size_t bytes             = 0;
+    size_t bytes_max         = 0;
+    size_t escapes           = 0;
+    size_t escapes_max       = 0;
+    size_t reset_bytes       = 0;
+    size_t mismatched_frames = 0;
+    size_t unknown_sequences = 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (frames < frames_target) {
+        int was_in_game = state.do_in_game_update;
+        if (was_in_game) {
+            char input = bench_bot_input();
+            write(input_pipe[1], &input, 1);
+        } else if (state.out_of_game_task == WAIT_FOR_REPLAY_OR_QUIT_INPUT) {
+            write(input_pipe[1], "r", 1);
+        }
+
+        vt_reset_counters(&vt);
+        update();
+        unknown_sequences += vt.unknown_sequences;
+
+        if (was_in_game && state.do_in_game_update) {
+            ++frames;
+            bytes   += vt.bytes;
+            escapes += vt.escape_sequences;
+            if (vt.bytes            > bytes_max  ) bytes_max   = vt.bytes;
+            if (vt.escape_sequences > escapes_max) escapes_max = vt.escape_sequences;
+            mismatched_frames += vt_count_grid_mismatches(&vt, &state) != 0;
+        } else if (!was_in_game && state.do_in_game_update) {
+            ++games;
+            reset_bytes += vt.bytes;
+            mismatched_frames += vt_count_grid_mismatches(&vt, &state) != 0;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)*1e-9;
+
+    printf("games                 %zu\n"     , games);
+    printf("in-game frames        %zu\n"     , frames);
+    printf("bytes/frame           %.2f avg, %zu max\n",
+           (double) bytes/frames, bytes_max);
+    printf("escape seqs/frame     %.2f avg, %zu max\n",
+           (double) escapes/frames, escapes_max);
+    printf("bytes/reset frame     %.2f avg\n", games ? (double) reset_bytes/games : 0.0);
+    printf("mismatched frames     %zu\n"     , mismatched_frames);
+    printf("unknown sequences     %zu\n"     , unknown_sequences);
+    printf("frames/s              %.0f\n"    , frames/elapsed);
+
+    // Sit on the end screen for a second, waiting the way `main` does,
+    // while a child process plays the user pressing r
+    char drain_buf[1024];
+    while (read(input_pipe[0], drain_buf, sizeof(drain_buf)) > 0);
+    if (fork() == 0) {
+        sleep(1);
+        write(input_pipe[1], "r", 1);
+        _exit(0);
+    }
+
+    state.do_in_game_update = 0;
+    state.out_of_game_task  = END_SCREEN;
+
+    size_t idle_wakeups = 0;
+    struct timespec idle_t0, idle_t1, idle_cpu0, idle_cpu1;
+    clock_gettime(CLOCK_MONOTONIC         , &idle_t0  );
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &idle_cpu0);
+    TickClock idle_clock = {.deadline = clock_now_ns()};
+
+    float update_interval = update();
+    while (state.out_of_game_task != RESET) {
+        wait_for_update(&state, update_interval, &idle_clock);
+        update_interval = update();
+        ++idle_wakeups;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC         , &idle_t1  );
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &idle_cpu1);
+    wait(NULL);
+    double idle_elapsed = (idle_t1.tv_sec - idle_t0.tv_sec)
+                        + (idle_t1.tv_nsec - idle_t0.tv_nsec)*1e-9;
+    double idle_cpu     = (idle_cpu1.tv_sec - idle_cpu0.tv_sec)
+                        + (idle_cpu1.tv_nsec - idle_cpu0.tv_nsec)*1e-9;
+
+    printf("idle wakeups/s        %.1f\n"    , idle_wakeups/idle_elapsed);
+    printf("idle CPU time         %.3f ms/s\n", idle_cpu*1e3/idle_elapsed);
+
+    // Tick timing with and without spinning, without any privileges
+    for (int realtime = 0; realtime < 2; ++realtime) {
+        TickClock tick_clock = {.deadline = clock_now_ns(), .realtime = realtime, .realtime_cpu = -1};
+        for (size_t i = 0; i < 500; ++i)
+            wait_for_update(&state, 0.002, &tick_clock);
+
+        printf("tick timing %-9s ", realtime ? "spin" : "sleep");
+        tick_clock_report(&tick_clock, stdout);
+    }
+
+    bench_levels();
+    bench_batch();
+
+    return mismatched_frames || unknown_sequences ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 #else // if TEST
 
+#include <string.h>
+#include <sys/wait.h>
+
 #include "test_framework.h"
 
+// Everything the rewind journal has to restore
+typedef struct test_snapshot {
+    unsigned char grid[256];
+    Vec           snake_head;
+    Vec           snake_tail;
+    Direction     snake_head_direction;
+    Direction     snake_tail_direction;
+    Vec           food;
+    size_t        score;
+    size_t        snake_grow_countdown;
+} TestSnapshot;
+
+void test_snapshot_take(TestSnapshot* snapshot, State* state) {
+    memcpy(snapshot->grid, state->grid, (state->grid_dims.x*state->grid_dims.y + 3)>>2);
+    snapshot->snake_head           = state->snake_head;
+    snapshot->snake_tail           = state->snake_tail;
+    snapshot->snake_head_direction = state->snake_head_direction;
+    snapshot->snake_tail_direction = state->snake_tail_direction;
+    snapshot->food                 = state->food;
+    snapshot->score                = state->score;
+    snapshot->snake_grow_countdown = state->snake_grow_countdown;
+}
+
+size_t test_snapshot_matches(TestSnapshot* snapshot, State* state) {
+    return memcmp(snapshot->grid, state->grid, (state->grid_dims.x*state->grid_dims.y + 3)>>2) == 0
+        && snapshot->snake_head.x         == state->snake_head.x
+        && snapshot->snake_head.y         == state->snake_head.y
+        && snapshot->snake_tail.x         == state->snake_tail.x
+        && snapshot->snake_tail.y         == state->snake_tail.y
+        && snapshot->snake_head_direction == state->snake_head_direction
+        && snapshot->snake_tail_direction == state->snake_tail_direction
+        && snapshot->food.x               == state->food.x
+        && snapshot->food.y               == state->food.y
+        && snapshot->score                == state->score
+        && snapshot->snake_grow_countdown == state->snake_grow_countdown;
+}
+
+// Plays 40 ticks going round in a rectangle, snapshotting before each tick
+// and after the last
+void test_journal_play(State* state, int input_fd, TestSnapshot* snapshots) {
+    char* moves = "     s      a       w      d            ";
+
+    state->do_in_game_update = 0;
+    state->out_of_game_task  = RESET;
+    game_update(state);
+
+    // Food moved between ticks isn't journaled, so it can only be moved into
+    // the snake's way before the first one
+    Vec ahead = state->snake_head;
+    snake_step(&ahead, state->snake_head_direction, state->grid_dims);
+    state->food = ahead;
+
+    for (size_t i = 0; i < 40; ++i) {
+        test_snapshot_take(&snapshots[i], state);
+
+        if (moves[i] != ' ')
+            write(input_fd, &moves[i], 1);
+        game_update(state);
+        test_assert(state->do_in_game_update, "died at tick %ld", i);
+    }
+    test_snapshot_take(&snapshots[40], state);
+}
+
+// Sets up a State like `batch_reset` sets up a game, so that it can be
+// stepped with the scalar functions alongside the batch
+void test_batch_reference_reset(State* reference, unsigned char* grid,
+                                Batch* batch, size_t game) {
+    size_t group = game/BATCH_LANES;
+    size_t lane  = game%BATCH_LANES;
+
+    for (size_t i = 0; i < batch->grid_stride; ++i)
+        grid[i] = 0;
+    reference->grid      = grid;
+    reference->grid_dims = batch->grid_dims;
+
+    reference->snake_head.x = batch->grid_dims.x>>1;
+    reference->snake_head.y = batch->grid_dims.y>>1;
+    reference->snake_tail   = reference->snake_head;
+    reference->snake_head_direction = RIGHT;
+    reference->snake_tail_direction = RIGHT;
+    reference->snake_grow_countdown = batch->snake_grow_increment;
+    reference->score = 0;
+    snake_start(reference, reference->snake_head);
+
+    reference->food.x = batch->food_x[group][lane];
+    reference->food.y = batch->food_y[group][lane];
+}
+
+// Keys written to `input_pipe[1]` are read by the game and what it draws
+// lands in `vt`. Without a TTY `get_terminal_dims` falls back to an 80x24
+// terminal.
+typedef struct test_terminal {
+    int          input_pipe[2];
+    unsigned int cells[80*24];
+    Vt           vt;
+} TestTerminal;
+
+// Attaches `state` to a fresh terminal and resets it into a new game
+void test_terminal_open(TestTerminal* terminal, State* state) {
+    pipe(terminal->input_pipe);
+    fcntl(terminal->input_pipe[0], F_SETFL, O_NONBLOCK);
+    vt_init(&terminal->vt, terminal->cells, (Vec) {.x = 80, .y = 24});
+
+    state->terminal_in_fd    = terminal->input_pipe[0];
+    state->vt                = &terminal->vt;
+    state->do_in_game_update = 0;
+    state->out_of_game_task  = RESET;
+    game_update(state);
+}
+
+void test_terminal_close(TestTerminal* terminal, State* state) {
+    grid_free(state);
+    terminal_out_free(state);
+    state->vt = NULL;
+    close(terminal->input_pipe[0]);
+    if (terminal->input_pipe[1] != -1)
+        close(terminal->input_pipe[1]);
+}
+
 int main(void) {
     test_begin("encode_direction_change"); {
         test_assert(encode_direction_change(UP, UP   ) == 2,
@@ -767,6 +3493,861 @@ int main(void) {
             }
         }; test_end();
     }; test_end();
+    test_begin("vt emulator"); {
+        unsigned int cells[8*4];
+        Vt vt;
+        vt_init(&vt, cells, (Vec) {.x = 8, .y = 4});
+
+        test_begin("cursor position and utf-8"); {
+            char* out = "\033[2;3Hab\033[4;7H\xe2\x96\x88\xe2\x96\x93";
+            vt_feed(&vt, out, strlen(out));
+
+            test_assert(vt_at(&vt, 2, 1) == 'a' && vt_at(&vt, 3, 1) == 'b',
+                       "'ab' not at <2,1>");
+            test_assert(vt_at(&vt, 6, 3) == 0x2588, "<6,3> == %x, not 2588", vt_at(&vt, 6, 3));
+            test_assert(vt_at(&vt, 7, 3) == 0x2593, "<7,3> == %x, not 2593", vt_at(&vt, 7, 3));
+            test_assert(vt.bytes == strlen(out),
+                       "bytes == %ld, not %ld", vt.bytes, strlen(out));
+            test_assert(vt.escape_sequences == 2,
+                       "escape_sequences == %ld, not 2", vt.escape_sequences);
+            test_assert(vt.cursor_moves == 2,
+                       "cursor_moves == %ld, not 2", vt.cursor_moves);
+            test_assert(vt.printed_chars == 4,
+                       "printed_chars == %ld, not 4", vt.printed_chars);
+        }; test_end();
+
+        test_begin("split sequences"); {
+            vt_feed(&vt, "\033[1", 3);
+            vt_feed(&vt, ";8H\xe2\x96", 5);
+            vt_feed(&vt, "\x88x", 2);
+
+            test_assert(vt_at(&vt, 7, 0) == 0x2588, "<7,0> == %x, not 2588", vt_at(&vt, 7, 0));
+            test_assert(vt.clipped_chars == 1,
+                       "clipped_chars == %ld, not 1", vt.clipped_chars);
+        }; test_end();
+
+        test_begin("cursor hide and show"); {
+            vt_feed(&vt, "\033[?25l", 6);
+            test_assert(!vt.cursor_visible, "cursor visible after hide");
+            vt_feed(&vt, "\033[?25h", 6);
+            test_assert(vt.cursor_visible, "cursor hidden after show");
+        }; test_end();
+
+        test_begin("erase display"); {
+            vt_feed(&vt, "\033[2J", 4);
+            test_assert(vt_at(&vt, 2, 1) == ' ' && vt_at(&vt, 6, 3) == ' ',
+                       "screen not cleared");
+            test_assert(vt.unknown_sequences == 0,
+                       "unknown_sequences == %ld, not 0", vt.unknown_sequences);
+        }; test_end();
+
+        test_begin("unknown sequences"); {
+            vt_feed(&vt, "\033[3m\033c\n", 7);
+            test_assert(vt.unknown_sequences == 3,
+                       "unknown_sequences == %ld, not 3", vt.unknown_sequences);
+        }; test_end();
+    }; test_end();
+    test_begin("timer wheel"); {
+        static TimerWheel wheel;
+        WheelTimer timer;
+
+        test_begin("wrapped level 0 slot"); {
+            memset(&wheel, 0, sizeof(wheel));
+            wheel.now = 250;
+            timer.deadline = 260;
+            wheel_insert(&wheel, &timer);
+
+            test_assert(timer.slot == &wheel.slots[0][4], "not in level 0 slot 4");
+            // Wakes up for the cascade at 256 first, then finds slot 4
+            test_assert(wheel_timeout(&wheel) == 6, "timeout == %d, not 6", wheel_timeout(&wheel));
+            test_assert(wheel_expire(&wheel, 259) == NULL, "expired before 260");
+            test_assert(wheel_timeout(&wheel) == 1, "timeout == %d, not 1", wheel_timeout(&wheel));
+            test_assert(wheel_expire(&wheel, 1000) == &timer && wheel.now == 260,
+                       "not expired at 260, now == %lld", wheel.now);
+            test_assert(timer.slot == NULL && wheel_timeout(&wheel) == -1, "still on the wheel");
+        }; test_end();
+
+        test_begin("cascades"); {
+            unsigned long long deadlines[] = {400, 65536 + 70, 200000};
+            size_t             levels   [] = {1, 1, 2};
+            for (size_t i = 0; i < 3; ++i) {
+                memset(&wheel, 0, sizeof(wheel));
+                wheel.now = 100;
+                timer.deadline = deadlines[i];
+                wheel_insert(&wheel, &timer);
+
+                test_assert(timer.slot >= wheel.slots[levels[i]]
+                         && timer.slot <  wheel.slots[levels[i]] + WHEEL_SLOTS,
+                           "deadline %lld not on level %ld", deadlines[i], levels[i]);
+                test_assert(wheel_expire(&wheel, deadlines[i] - 1) == NULL,
+                           "deadline %lld expired early", deadlines[i]);
+                test_assert(timer.slot == &wheel.slots[0][deadlines[i] & WHEEL_SLOT_MASK],
+                           "deadline %lld not cascaded down to level 0", deadlines[i]);
+                test_assert(wheel_expire(&wheel, deadlines[i] + 1000) == &timer
+                         && wheel.now == deadlines[i],
+                           "deadline %lld expired at %lld", deadlines[i], wheel.now);
+            }
+        }; test_end();
+
+        test_begin("clamps past the top level"); {
+            memset(&wheel, 0, sizeof(wheel));
+            wheel.now = 5;
+            timer.deadline = 5 + (3ull<<24);
+            wheel_insert(&wheel, &timer);
+
+            test_assert(timer.slot >= wheel.slots[WHEEL_LEVELS - 1]
+                     && timer.slot <  wheel.slots[WHEEL_LEVELS - 1] + WHEEL_SLOTS,
+                       "not on the top level");
+            test_assert(wheel_expire(&wheel, timer.deadline - 1) == NULL,
+                       "expired early");
+            test_assert(wheel_expire(&wheel, timer.deadline) == &timer
+                     && wheel.now == timer.deadline,
+                       "expired at %lld", wheel.now);
+        }; test_end();
+
+        test_begin("timeout is -1 only when empty"); {
+            memset(&wheel, 0, sizeof(wheel));
+            test_assert(wheel_timeout(&wheel) == -1, "empty wheel has a timeout");
+
+            for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+                wheel.now = 1000;
+                timer.deadline = wheel.now + (1ull<<(level*WHEEL_SLOT_BITS)) + 10;
+                wheel_insert(&wheel, &timer);
+                test_assert(wheel_timeout(&wheel) > 0,
+                           "level %ld: timeout == %d", level, wheel_timeout(&wheel));
+                wheel_remove(&timer);
+                test_assert(wheel_timeout(&wheel) == -1,
+                           "level %ld: timeout after removal == %d", level, wheel_timeout(&wheel));
+            }
+
+            // Due right away
+            timer.deadline = wheel.now;
+            wheel_insert(&wheel, &timer);
+            test_assert(wheel_expire(&wheel, wheel.now) == &timer, "due timer not expired");
+        }; test_end();
+
+        test_begin("catches up after idling"); {
+            const unsigned long long DAY = 24*60*60*1000ull;
+
+            memset(&wheel, 0, sizeof(wheel));
+            wheel.now = 12345;
+            test_assert(wheel_expire(&wheel, wheel.now + DAY) == NULL && wheel.now == 12345 + DAY,
+                       "empty wheel at %lld, not %lld", wheel.now, 12345 + DAY);
+
+            // Both levels of cascades and a wrapped level 0 slot on the way
+            unsigned long long deadlines[] = {wheel.now + 255, wheel.now + 70000, wheel.now + DAY};
+            WheelTimer         timers[3];
+            for (size_t i = 0; i < 3; ++i) {
+                timers[i].deadline = deadlines[i];
+                wheel_insert(&wheel, &timers[i]);
+            }
+            for (size_t i = 0; i < 3; ++i) {
+                WheelTimer* expired = wheel_expire(&wheel, deadlines[2] + 1000);
+                test_assert(expired == &timers[i] && wheel.now == deadlines[i],
+                           "timer %ld expired at %lld, not %lld", i, wheel.now, deadlines[i]);
+            }
+            test_assert(wheel_expire(&wheel, deadlines[2] + 1000) == NULL
+                     && wheel.now == deadlines[2] + 1000,
+                       "not caught up to the end");
+        }; test_end();
+    }; test_end();
+    test_begin("rendering"); {
+        static TestTerminal terminal;
+        Vt* vt = &terminal.vt;
+        test_terminal_open(&terminal, &state);
+
+        test_begin("reset"); {
+            test_assert(state.do_in_game_update, "not in game after reset");
+            test_assert(!vt->cursor_visible, "cursor visible in game");
+            test_assert(vt_at(vt, 7, 0) == '0', "score not drawn");
+            size_t mismatches = vt_count_grid_mismatches(vt, &state);
+            test_assert(mismatches == 0, "%ld grid cells mismatched", mismatches);
+        }; test_end();
+
+        test_begin("ticks"); {
+            // Food is placed randomly, so keep it out of our path along the
+            // row the snake starts in
+            if (state.food.y == state.snake_head.y)
+                state.food.y = (state.food.y + 1) % state.grid_dims.y;
+            terminal_move_cursor_to_grid_pos(&state, state.food);
+            terminal_write(&state, "▓▓");
+            terminal_flush_out(&state);
+
+            for (size_t i = 0; i < 10; ++i) {
+                vt_reset_counters(vt);
+                update();
+
+                size_t mismatches = vt_count_grid_mismatches(vt, &state);
+                test_assert(mismatches == 0,
+                           "tick %ld: %ld grid cells mismatched", i, mismatches);
+                // Moving the head costs one cursor move and 6 bytes of text,
+                // once growing stops the tail costs another cursor move and 2
+                // spaces
+                size_t expected_escapes = i < state.snake_grow_increment ? 1 : 2;
+                test_assert(vt->escape_sequences == expected_escapes,
+                           "tick %ld: escape_sequences == %ld, not %ld",
+                           i, vt->escape_sequences, expected_escapes);
+            }
+        }; test_end();
+
+        test_begin("quit"); {
+            write(terminal.input_pipe[1], "q", 1);
+            update();
+            update();
+
+            test_assert(vt->cursor_visible, "cursor not restored on teardown");
+            test_assert(vt->unknown_sequences == 0,
+                       "unknown_sequences == %ld, not 0", vt->unknown_sequences);
+        }; test_end();
+
+        test_terminal_close(&terminal, &state);
+    }; test_end();
+    test_begin("idle end screen"); {
+        static TestTerminal terminal;
+        int* input_pipe = terminal.input_pipe;
+        test_terminal_open(&terminal, &state);
+
+        state.do_in_game_update = 0;
+        state.out_of_game_task  = END_SCREEN;
+        float update_interval = update();
+        test_assert(update_interval == UPDATE_ON_INPUT,
+                   "END_SCREEN update_interval == %f, not UPDATE_ON_INPUT", update_interval);
+
+        update_interval = update();
+        test_assert(update_interval == UPDATE_ON_INPUT,
+                   "update_interval without input == %f, not UPDATE_ON_INPUT", update_interval);
+
+        write(input_pipe[1], "x", 1);
+        update_interval = update();
+        test_assert(update_interval == UPDATE_ON_INPUT,
+                   "update_interval after other key == %f, not UPDATE_ON_INPUT", update_interval);
+
+        write(input_pipe[1], "r", 1);
+        update_interval = update();
+        test_assert(update_interval == 0,
+                   "update_interval after replay == %f, not 0", update_interval);
+        test_assert(state.out_of_game_task == RESET,
+                   "out_of_game_task == %d, not RESET", state.out_of_game_task);
+
+        write(input_pipe[1], "q", 1);
+        update();
+        update();
+        update();
+
+        // Nobody left to press a key, so the wait must end in a quit
+        // instead of returning straight away forever
+        state.do_in_game_update = 0;
+        state.out_of_game_task  = RESET;
+        update();
+        state.do_in_game_update = 0;
+        state.out_of_game_task  = END_SCREEN;
+        update_interval = update();
+        close(input_pipe[1]);
+        input_pipe[1] = -1;
+
+        TickClock clock = {.deadline = clock_now_ns()};
+        size_t waits = 0;
+        while ((state.do_in_game_update || state.out_of_game_task != TEARDOWN) && waits < 100) {
+            wait_for_update(&state, update_interval, &clock);
+            update_interval = update();
+            ++waits;
+        }
+        test_assert(waits == 1, "%ld waits on a closed pipe, not 1", waits);
+        update();
+        test_terminal_close(&terminal, &state);
+    }; test_end();
+    test_begin("terminal output"); {
+        test_begin("writer keeps order"); {
+            int out_pipe[2];
+            pipe(out_pipe);
+
+            State out_state = {0};
+            out_state.terminal_writer = terminal_writer_start(out_pipe[1]);
+            test_assert(out_state.terminal_writer, "writer thread not started");
+
+            // Fits in the pipe, so nothing waits on us reading
+            static char expected[8192];
+            size_t expected_n = 0;
+            for (size_t i = 0; i < 1000; ++i) {
+                terminal_write_int(&out_state, i);
+                terminal_write(&out_state, ";");
+                terminal_flush_out(&out_state);
+                expected_n += sprintf(expected + expected_n, "%zu;", i);
+            }
+            terminal_writer_stop(out_state.terminal_writer);
+            close(out_pipe[1]);
+
+            static char got[8192];
+            size_t got_n = 0;
+            ssize_t n;
+            while ((n = read(out_pipe[0], got + got_n, sizeof(got) - got_n)) > 0)
+                got_n += n;
+            close(out_pipe[0]);
+
+            test_assert(got_n == expected_n, "%ld bytes written, not %ld", got_n, expected_n);
+            test_assert(memcmp(got, expected, expected_n) == 0, "output out of order");
+            terminal_out_free(&out_state);
+        }; test_end();
+
+        test_begin("stalled terminal"); {
+            int out_pipe[2];
+            pipe(out_pipe);
+            fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(out_pipe[1], F_SETFL, O_NONBLOCK);
+
+            // Fill the pipe up front, down to the last byte, so that the
+            // writer can't make room in the ring at some point during the
+            // loop below and take part of a redraw
+            static char filler[4096];
+            while (write(out_pipe[1], filler, sizeof(filler)) > 0);
+            while (write(out_pipe[1], filler, 1) > 0);
+
+            // Start a game on the test terminal, then switch to a writer
+            // for the rest
+            static TestTerminal terminal;
+            State out_state = {0};
+            out_state.terminal_out_max = 4096;
+            test_terminal_open(&terminal, &out_state);
+            out_state.vt              = NULL;
+            out_state.terminal_writer = terminal_writer_start(out_pipe[1]);
+
+            // Nobody reads the pipe, so this fills it, then the ring, then
+            // overflows the cap many times over, and must still return
+            for (size_t i = 0; i < 4096; ++i) {
+                for (size_t j = 0; j < 16; ++j)
+                    terminal_move_cursor(&out_state, 0, 0);
+                terminal_flush_out(&out_state);
+                test_assert(out_state.terminal_out_len <= out_state.terminal_out_max,
+                           "%ld bytes unsent, cap is %ld",
+                           out_state.terminal_out_len, out_state.terminal_out_max);
+            }
+
+            // What is left starts with a redraw, which must bring a terminal
+            // in any state up to date
+            for (size_t i = 0; i < 80*24; ++i)
+                terminal.cells[i] = 'x';
+            vt_feed(&terminal.vt, out_state.terminal_out, out_state.terminal_out_len);
+            size_t mismatches = vt_count_grid_mismatches(&terminal.vt, &out_state);
+            test_assert(mismatches == 0, "%ld grid cells mismatched", mismatches);
+            test_assert(vt_at(&terminal.vt, 0, 0) == 'S', "score not redrawn");
+
+            // Let the writer finish before stopping it
+            char drain[4096];
+            while (__atomic_load_n(&out_state.terminal_writer->tail, __ATOMIC_ACQUIRE)
+                    != out_state.terminal_writer->head
+                    || read(out_pipe[0], drain, sizeof(drain)) > 0) {
+                read(out_pipe[0], drain, sizeof(drain));
+            }
+            terminal_writer_stop(out_state.terminal_writer);
+
+            test_terminal_close(&terminal, &out_state);
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }; test_end();
+
+        test_begin("redraw keeps the end screen"); {
+            static unsigned int cells[80*24];
+            Vt vt;
+            vt_init(&vt, cells, (Vec) {.x = 80, .y = 24});
+
+            // Like a server session: the grid is gone once the end screen
+            // is up
+            State end_state = {0};
+            end_state.vt               = &vt;
+            end_state.terminal_dims    = (Vec) {.x = 79, .y = 24};
+            end_state.terminal_out_max = 64;
+            end_state.score            = 7;
+            end_state.out_of_game_task = WAIT_FOR_REPLAY_OR_QUIT_INPUT;
+            for (size_t i = 0; i < 64; ++i)
+                terminal_move_cursor(&end_state, 0, 0);
+            terminal_flush_out(&end_state);
+
+            size_t x = (79>>1) - 8;
+            size_t y = (24>>1) - 3;
+            test_assert(vt_at(&vt, x + 3, y) == 'G', "GAME OVER! not redrawn");
+            test_assert(vt_at(&vt, x + 14, y + 2) == '7', "final score not redrawn");
+            test_assert(vt_at(&vt, x + 4, y + 4) == 'r' && vt_at(&vt, x + 4, y + 5) == 'q',
+                       "r/q prompt not redrawn");
+
+            terminal_out_free(&end_state);
+        }; test_end();
+    }; test_end();
+    test_begin("rewind journal"); {
+        static TestTerminal terminal;
+        int* input_pipe = terminal.input_pipe;
+        State journal_state = {0};
+        journal_state.journal = journal_create(64);
+        test_terminal_open(&terminal, &journal_state);
+
+        static TestSnapshot snapshots[41];
+        test_journal_play(&journal_state, input_pipe[1], snapshots);
+        test_assert(journal_state.score > 0, "nothing eaten");
+
+        test_begin("steps back"); {
+            for (size_t i = 40; i > 0; --i) {
+                test_assert(journal_step_back(&journal_state), "tick %ld not undone", i - 1);
+                test_assert(test_snapshot_matches(&snapshots[i - 1], &journal_state),
+                           "state after undoing tick %ld differs", i - 1);
+            }
+            test_assert(!journal_step_back(&journal_state), "undid a tick before the first");
+        }; test_end();
+
+        test_begin("steps forward"); {
+            for (size_t i = 0; i < 40; ++i) {
+                test_assert(journal_step_forward(&journal_state), "tick %ld not redone", i);
+                test_assert(test_snapshot_matches(&snapshots[i + 1], &journal_state),
+                           "state after redoing tick %ld differs", i);
+            }
+            test_assert(!journal_step_forward(&journal_state), "redid a tick after the last");
+        }; test_end();
+
+        test_begin("rewinds from the end screen"); {
+            // Reversing runs into the neck
+            char reverse = "wdsa"[(journal_state.snake_head_direction + 2) & 3];
+            write(input_pipe[1], &reverse, 1);
+            game_update(&journal_state);
+            test_assert(journal_state.out_of_game_task == END_SCREEN,
+                       "out_of_game_task == %d, not END_SCREEN", journal_state.out_of_game_task);
+            test_assert(test_snapshot_matches(&snapshots[40], &journal_state),
+                       "state after the fatal move differs from the last tick");
+
+            game_update(&journal_state);
+            test_assert(journal_state.grid, "grid freed on the end screen");
+
+            write(input_pipe[1], "[", 1);
+            game_update(&journal_state);
+            write(input_pipe[1], "[", 1);
+            game_update(&journal_state);
+            test_assert(test_snapshot_matches(&snapshots[38], &journal_state),
+                       "state after rewinding 2 ticks differs");
+            size_t mismatches = vt_count_grid_mismatches(&terminal.vt, &journal_state);
+            test_assert(mismatches == 0, "%ld grid cells mismatched", mismatches);
+
+            write(input_pipe[1], "]", 1);
+            game_update(&journal_state);
+            test_assert(test_snapshot_matches(&snapshots[39], &journal_state),
+                       "state after stepping forward again differs");
+            test_assert(journal_state.out_of_game_task == WAIT_FOR_REPLAY_OR_QUIT_INPUT,
+                       "out_of_game_task == %d, not WAIT_FOR_REPLAY_OR_QUIT_INPUT",
+                       journal_state.out_of_game_task);
+        }; test_end();
+
+        test_begin("keeps the last ticks"); {
+            free(journal_state.journal);
+            journal_state.journal = journal_create(16);
+            test_journal_play(&journal_state, input_pipe[1], snapshots);
+
+            size_t undone = 0;
+            while (journal_step_back(&journal_state))
+                ++undone;
+            test_assert(undone == 16, "%ld ticks undone, not 16", undone);
+            test_assert(test_snapshot_matches(&snapshots[40 - 16], &journal_state),
+                       "state after undoing 16 ticks differs");
+        }; test_end();
+
+        test_terminal_close(&terminal, &journal_state);
+        free(journal_state.journal);
+    }; test_end();
+    test_begin("levels"); {
+        char path[] = "/tmp/snake-test-level-XXXXXX";
+        close(mkstemp(path));
+
+        // Walls round the edge, with a gap on the right, and a pillar
+        FILE* text = tmpfile();
+        fputs("#########\n"
+              "#  >    #\n"
+              "#   #    \n"
+              "#       #\n"
+              "#########\n", text);
+        rewind(text);
+        test_assert(level_make(text, path) == 0, "level_make failed");
+        fclose(text);
+
+        Level* level = level_open(path);
+        test_assert(level != NULL, "level_open(\"%s\") == NULL", path);
+
+        test_begin("loads in place"); {
+            test_assert(level->width == 9 && level->height == 5,
+                       "dims %ux%u, not 9x5", level->width, level->height);
+            test_assert(level->spawns_count == 1, "spawns_count == %u, not 1", level->spawns_count);
+            test_assert(level->spawns[0].x == 3 && level->spawns[0].y == 1
+                            && level->spawns[0].direction == RIGHT,
+                       "spawn (%d, %d) facing %d, not (3, 1) facing RIGHT",
+                       level->spawns[0].x, level->spawns[0].y, level->spawns[0].direction);
+
+            size_t walls = 0;
+            for (size_t y = 0; y < 5; ++y)
+                for (size_t x = 0; x < 9; ++x)
+                    walls += level_wall_at(level, (Vec) {.x = x, .y = y});
+            test_assert(walls == 9 + 2 + 2 + 2 + 9, "%ld walls, not 24", walls);
+            test_assert(level_wall_at(level, (Vec) {.x = 4, .y = 2}), "pillar missing");
+            test_assert(!level_wall_at(level, (Vec) {.x = 8, .y = 2}), "gap walled");
+        }; test_end();
+
+        static TestTerminal terminal;
+        State level_state = {0};
+        level_state.level = level;
+        test_terminal_open(&terminal, &level_state);
+
+        test_begin("food skips walls"); {
+            for (size_t i = 0; i < 200; ++i) {
+                level_state.do_in_game_update = 0;
+                level_state.out_of_game_task  = RESET;
+                game_update(&level_state);
+
+                test_assert(!level_wall_at(level, level_state.food),
+                           "food on the wall at (%ld, %ld)", level_state.food.x, level_state.food.y);
+            }
+        }; test_end();
+
+        test_begin("walls are collisions"); {
+            vt_init(&terminal.vt, terminal.cells, (Vec) {.x = 80, .y = 24});
+            level_state.do_in_game_update = 0;
+            level_state.out_of_game_task  = RESET;
+            game_update(&level_state);
+
+            test_assert(level_state.grid_dims.x == 9 && level_state.grid_dims.y == 5,
+                       "grid %ldx%ld, not 9x5", level_state.grid_dims.x, level_state.grid_dims.y);
+            test_assert(level_state.snake_head.x == 3 && level_state.snake_head.y == 1,
+                       "not spawned at (3, 1)");
+            size_t mismatches = vt_count_grid_mismatches(&terminal.vt, &level_state);
+            test_assert(mismatches == 0, "%ld grid cells mismatched after reset", mismatches);
+
+            // 4 cells to go until the right wall
+            size_t ticks = 0;
+            while (level_state.do_in_game_update && ticks < 10) {
+                game_update(&level_state);
+                ++ticks;
+
+                mismatches = vt_count_grid_mismatches(&terminal.vt, &level_state);
+                test_assert(mismatches == 0, "tick %ld: %ld grid cells mismatched", ticks, mismatches);
+            }
+            test_assert(ticks == 5, "hit the wall on tick %ld, not 5", ticks);
+            test_assert(level_state.out_of_game_task == END_SCREEN,
+                       "out_of_game_task == %d, not END_SCREEN", level_state.out_of_game_task);
+        }; test_end();
+
+        test_begin("filling the level ends the game"); {
+            // Room for the snake and one food
+            char full_path[] = "/tmp/snake-test-level-XXXXXX";
+            close(mkstemp(full_path));
+            FILE* full_text = tmpfile();
+            fputs("#> #\n", full_text);
+            rewind(full_text);
+            test_assert(level_make(full_text, full_path) == 0, "level_make failed");
+            fclose(full_text);
+
+            static TestTerminal full_terminal;
+            State full_state = {0};
+            full_state.level   = level_open(full_path);
+            full_state.journal = journal_create(16);
+            test_assert(full_state.level != NULL, "level_open(\"%s\") == NULL", full_path);
+            test_terminal_open(&full_terminal, &full_state);
+            test_assert(full_state.food.x == 2, "food at x == %ld, not 2", full_state.food.x);
+
+            size_t ticks = 0;
+            while (full_state.do_in_game_update && ticks < 10) {
+                game_update(&full_state);
+                ++ticks;
+            }
+            test_assert(ticks == 1, "game over on tick %ld, not 1", ticks);
+            test_assert(full_state.out_of_game_task == END_SCREEN,
+                       "out_of_game_task == %d, not END_SCREEN", full_state.out_of_game_task);
+            // Taken back to before the last tick, for rewinding
+            test_assert(full_state.snake_head.x == 1 && full_state.score == 0
+                            && snake_at(&full_state, (Vec) {.x = 2, .y = 0}) == 0,
+                       "last tick not withdrawn");
+
+            test_terminal_close(&full_terminal, &full_state);
+            level_close(full_state.level);
+            free(full_state.journal);
+            unlink(full_path);
+        }; test_end();
+
+        test_begin("rejects bad files"); {
+            struct stat file_stat;
+            stat(path, &file_stat);
+            truncate(path, file_stat.st_size - 1);
+            test_assert(level_open(path) == NULL, "truncated level opened");
+
+            // Nowhere for food besides the spawn, once with whole bytes of
+            // walls before it
+            char* no_room[] = {"#>#\n", "################\n#######>########\n"};
+            for (size_t i = 0; i < 2; ++i) {
+                FILE* no_room_text = tmpfile();
+                fputs(no_room[i], no_room_text);
+                rewind(no_room_text);
+                test_assert(level_make(no_room_text, path) == 0, "level_make failed");
+                fclose(no_room_text);
+                test_assert(level_open(path) == NULL, "level %ld without room for food opened", i);
+            }
+        }; test_end();
+
+        test_terminal_close(&terminal, &level_state);
+        level_close(level);
+        unlink(path);
+    }; test_end();
+    test_begin("batch"); {
+        Vec grid_dims = {.x = 16, .y = 12};
+        Batch* batch = batch_create(13, grid_dims, 42);
+
+        // 13 isn't a multiple of any lane count, so the last group is padded
+        const size_t GAMES = 13;
+        int           actions[13];
+        float         rewards[13];
+        unsigned char dones  [13];
+
+        test_begin("matches scalar stepping"); {
+            State         references[13];
+            unsigned char reference_grids[13][64];
+            for (size_t game = 0; game < GAMES; ++game)
+                test_batch_reference_reset(references + game, reference_grids[game], batch, game);
+
+            size_t dones_count = 0;
+            size_t eats_count  = 0;
+            for (size_t tick = 0; tick < 500; ++tick) {
+                // Turn clockwise or counter-clockwise every few ticks,
+                // differently per game
+                for (size_t game = 0; game < GAMES; ++game) {
+                    Direction direction = references[game].snake_head_direction;
+                    actions[game] = -1;
+                    if ((tick + game) % (3 + game%5) == 0)
+                        actions[game] = (direction + (game & 1 ? 1 : 3)) & 3;
+                    // and now and then reverse into the neck
+                    if (game%4 == 0 && tick%37 == 36)
+                        actions[game] = (direction + 2) & 3;
+                }
+
+                batch_step(batch, actions, rewards, dones);
+
+                for (size_t game = 0; game < GAMES; ++game) {
+                    size_t group = game/BATCH_LANES;
+                    size_t lane  = game%BATCH_LANES;
+                    State* reference = references + game;
+
+                    reference->snake_head_prev_direction = reference->snake_head_direction;
+                    if (actions[game] != -1)
+                        reference->snake_head_direction = actions[game];
+
+                    if (!snake_extend_head(reference)) {
+                        test_assert(dones[game] && rewards[game] == -1,
+                                   "tick %ld game %ld: collision not reported", tick, game);
+                        test_batch_reference_reset(reference, reference_grids[game], batch, game);
+                        ++dones_count;
+                        continue;
+                    }
+                    test_assert(!dones[game], "tick %ld game %ld: unexpected done", tick, game);
+
+                    if (reference->snake_head.x == reference->food.x
+                            && reference->snake_head.y == reference->food.y) {
+                        test_assert(rewards[game] == 1,
+                                   "tick %ld game %ld: eating not rewarded", tick, game);
+                        reference->snake_grow_countdown += batch->snake_grow_increment;
+                        ++reference->score;
+                        reference->food.x = batch->food_x[group][lane];
+                        reference->food.y = batch->food_y[group][lane];
+                        ++eats_count;
+                    }
+
+                    if (reference->snake_grow_countdown == 0)
+                        snake_retract_tail(reference);
+                    else
+                        --reference->snake_grow_countdown;
+
+                    test_assert(batch->snake_head_x[group][lane] == reference->snake_head.x
+                             && batch->snake_head_y[group][lane] == reference->snake_head.y,
+                               "tick %ld game %ld: head mismatch", tick, game);
+                    test_assert(batch->snake_tail_x[group][lane] == reference->snake_tail.x
+                             && batch->snake_tail_y[group][lane] == reference->snake_tail.y,
+                               "tick %ld game %ld: tail mismatch", tick, game);
+                    test_assert(batch->score[group][lane] == reference->score,
+                               "tick %ld game %ld: score mismatch", tick, game);
+                    test_assert(memcmp(batch->grids + game*batch->grid_stride,
+                                       reference->grid, batch->grid_stride) == 0,
+                               "tick %ld game %ld: grid mismatch", tick, game);
+                }
+            }
+
+            // Make sure the interesting paths were taken at all
+            test_assert(dones_count > 0, "no game died");
+            test_assert(eats_count  > 0, "no game ate");
+        }; test_end();
+
+        test_begin("reversing is fatal and resets"); {
+            for (size_t game = 0; game < GAMES; ++game)
+                batch_reset(batch, game);
+            for (size_t game = 0; game < GAMES; ++game)
+                actions[game] = -1;
+            batch_step(batch, actions, rewards, dones);
+            actions[3] = LEFT;
+            batch_step(batch, actions, rewards, dones);
+
+            test_assert(dones[3] && rewards[3] == -1, "game 3 not done");
+            test_assert(!dones[2] && !dones[4], "neighbouring games done");
+            test_assert(batch->snake_head_x[0][3] == grid_dims.x>>1,
+                       "game 3 head.x == %d, not reset", batch->snake_head_x[0][3]);
+        }; test_end();
+
+        batch_destroy(batch);
+
+        test_begin("filling the grid wins and resets"); {
+            test_assert(batch_create(1, (Vec) {.x = 1, .y = 1}, 1) == NULL,
+                       "1x1 grid accepted");
+
+            // Going right on a single row the snake eats every food it meets
+            size_t widths[] = {2, 4};
+            for (size_t i = 0; i < 2; ++i) {
+                Batch* tiny = batch_create(3, (Vec) {.x = widths[i], .y = 1}, 5);
+                int    no_actions[3] = {-1, -1, -1};
+                size_t wins_count = 0;
+                for (size_t tick = 0; tick < 100; ++tick) {
+                    batch_step(tiny, no_actions, rewards, dones);
+                    for (size_t game = 0; game < 3; ++game) {
+                        wins_count += dones[game] && rewards[game] == 1;
+
+                        size_t occupied = 0;
+                        for (size_t x = 0; x < widths[i]; ++x)
+                            occupied += batch_snake_at(tiny, game, x, 0) != 0;
+                        test_assert(tiny->snake_length[0][game] == occupied,
+                                   "%ldx1 tick %ld game %ld: length %d, %ld cells taken",
+                                   widths[i], tick, game, tiny->snake_length[0][game], occupied);
+                    }
+                }
+                test_assert(wins_count > 0, "%ldx1: grid never filled", widths[i]);
+                batch_destroy(tiny);
+            }
+        }; test_end();
+    }; test_end();
+    test_begin("environment api"); {
+        // 35 cells, so unpacking ends on a partial byte and a partial word
+        const size_t WIDTH  = 7;
+        const size_t HEIGHT = 5;
+        const size_t CELLS  = 7*5;
+        SnakeEnv* env = snake_env_create(5, WIDTH, HEIGHT, 7);
+
+        test_assert(snake_env_observation_size(env) == 3*CELLS,
+                   "observation_size == %ld, not %ld",
+                   snake_env_observation_size(env), 3*CELLS);
+
+        // One extra game's worth to catch writes past the end
+        static unsigned char observations[6*3*7*5];
+        int           actions[6] = {-1, -1, -1, -1, -1, 0x5A5A5A5A};
+        float         rewards[6] = {0, 0, 0, 0, 0, 12345};
+        unsigned char dones  [6] = {0, 0, 0, 0, 0, 0x5A};
+        memset(observations, 0x5A, sizeof(observations));
+
+        snake_env_reset(env, observations);
+        for (size_t tick = 0; tick < 40; ++tick) {
+            actions[tick%5] = tick%3 ? -1 : (int) (tick/3)%4;
+            snake_env_step(env, actions, rewards, dones, observations);
+
+            for (size_t game = 0; game < 5; ++game) {
+                size_t group = game/BATCH_LANES;
+                size_t lane  = game%BATCH_LANES;
+                unsigned char* observation = observations + game*3*CELLS;
+
+                size_t occupancy_mismatches = 0;
+                size_t head_count = 0;
+                size_t food_count = 0;
+                for (size_t idx = 0; idx < CELLS; ++idx) {
+                    size_t x = idx%WIDTH;
+                    size_t y = idx/WIDTH;
+                    occupancy_mismatches += observation[SNAKE_ENV_PLANE_OCCUPANCY*CELLS + idx]
+                                         != (batch_snake_at(env, game, x, y) != 0);
+                    head_count += observation[SNAKE_ENV_PLANE_HEAD*CELLS + idx];
+                    food_count += observation[SNAKE_ENV_PLANE_FOOD*CELLS + idx];
+                }
+                size_t head_idx = env->snake_head_y[group][lane]*WIDTH + env->snake_head_x[group][lane];
+                size_t food_idx = env->food_y      [group][lane]*WIDTH + env->food_x      [group][lane];
+
+                test_assert(occupancy_mismatches == 0,
+                           "tick %ld game %ld: %ld occupancy mismatches",
+                           tick, game, occupancy_mismatches);
+                test_assert(head_count == 1 && observation[SNAKE_ENV_PLANE_HEAD*CELLS + head_idx],
+                           "tick %ld game %ld: head plane wrong", tick, game);
+                test_assert(food_count == 1 && observation[SNAKE_ENV_PLANE_FOOD*CELLS + food_idx],
+                           "tick %ld game %ld: food plane wrong", tick, game);
+            }
+        }
+
+        test_assert(observations[5*3*CELLS] == 0x5A && rewards[5] == 12345 && dones[5] == 0x5A,
+                   "wrote past the last game");
+
+        snake_env_close(env);
+
+        test_assert(snake_env_create(1, 0, 5, 7) == NULL && snake_env_create(1, 5, 0, 7) == NULL,
+                   "empty grid accepted");
+        test_assert(snake_env_create(1, 1, 1, 7) == NULL, "1x1 grid accepted");
+        test_assert(snake_env_create(1, 1<<16, 1<<16, 7) == NULL, "2^32 cells accepted");
+
+        // A snake filling a 2x1 grid ends the episode instead of hanging
+        env = snake_env_create(1, 2, 1, 7);
+        int tiny_action = -1;
+        snake_env_reset(env, observations);
+        snake_env_step(env, &tiny_action, rewards, dones, observations);
+        test_assert(dones[0] && rewards[0] == 1, "full 2x1 grid not done");
+        snake_env_close(env);
+    }; test_end();
+    test_begin("high scores"); {
+        char path[] = "/tmp/snake-test-high-scores-XXXXXX";
+        close(mkstemp(path));
+
+        HighScores* high_scores = high_scores_open(path);
+        test_assert(high_scores != NULL, "high_scores_open(\"%s\") == NULL", path);
+
+        test_begin("submit and read back"); {
+            high_scores_submit(high_scores, 5, 100);
+            high_scores_submit(high_scores, 9, 101);
+            high_scores_submit(high_scores, 0, 102);
+            high_scores_submit(high_scores, 7, 103);
+
+            unsigned long long records[8];
+            size_t count = high_scores_top(high_scores, records, 8);
+            test_assert(count == 3, "count == %ld, not 3", count);
+            test_assert(records[0]>>32 == 9 && records[1]>>32 == 7 && records[2]>>32 == 5,
+                       "records not ordered best first");
+            test_assert((records[1] & 0xFFFFFFFF) == 103,
+                       "time == %lld, not 103", records[1] & 0xFFFFFFFF);
+            test_assert(high_scores_best(high_scores) == 9,
+                       "best == %ld, not 9", high_scores_best(high_scores));
+        }; test_end();
+
+        test_begin("persists across mappings"); {
+            HighScores* reopened = high_scores_open(path);
+            test_assert(high_scores_best(reopened) == 9,
+                       "best == %ld, not 9", high_scores_best(reopened));
+            munmap(reopened, sizeof(HighScores));
+        }; test_end();
+
+        test_begin("concurrent processes keep the largest"); {
+            // Every process submits an interleaved slice of 1..4000
+            const size_t PROCESSES = 4;
+            const size_t SCORES    = 4000;
+            for (size_t p = 0; p < PROCESSES; ++p) {
+                if (fork() == 0) {
+                    HighScores* child_high_scores = high_scores_open(path);
+                    for (size_t score = p + 1; score <= SCORES; score += PROCESSES)
+                        high_scores_submit(child_high_scores, score, 0);
+                    _exit(0);
+                }
+            }
+            for (size_t p = 0; p < PROCESSES; ++p)
+                wait(NULL);
+
+            unsigned long long records[HIGH_SCORES_COUNT];
+            size_t count = high_scores_top(high_scores, records, HIGH_SCORES_COUNT);
+            test_assert(count == HIGH_SCORES_COUNT,
+                       "count == %ld, not %d", count, HIGH_SCORES_COUNT);
+            for (size_t i = 0; i < count; ++i) {
+                test_assert(records[i]>>32 == SCORES - i,
+                           "records[%ld] score == %lld, not %ld",
+                           i, records[i]>>32, SCORES - i);
+            }
+        }; test_end();
+
+        munmap(high_scores, sizeof(HighScores));
+        unlink(path);
+    }; test_end();
 
     return test_report_returning_exit_status();
 }
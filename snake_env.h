@@ -0,0 +1,41 @@
+// C ABI of libsnake.so, many snake games stepped in lockstep for training
+// harnesses. See "Environment API" in snake.c for the observation layout.
+#ifndef SNAKE_ENV_H
+#define SNAKE_ENV_H
+
+#include <stddef.h>
+
+#define SNAKE_ENV_PLANE_OCCUPANCY 0
+#define SNAKE_ENV_PLANE_HEAD      1
+#define SNAKE_ENV_PLANE_FOOD      2
+#define SNAKE_ENV_PLANES_COUNT    3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Actions are 0=up, 1=right, 2=down, 3=left or -1 to keep going
+typedef struct batch SnakeEnv;
+
+// Returns NULL if out of memory, if width or height is 0, if the grid has
+// fewer than 2 cells or if width*height doesn't fit in 32 bits
+SnakeEnv* snake_env_create(size_t envs_count, size_t width, size_t height, unsigned int seed);
+
+// Bytes of observation per env. `observations` buffers hold
+// envs_count*snake_env_observation_size(env) bytes, env after env.
+size_t    snake_env_observation_size(SnakeEnv* env);
+
+// `actions`, `rewards` and `dones` hold envs_count entries. Rewards are +1
+// for eating and -1 for dying. Envs that died or filled the grid are done
+// and have been reset. `observations` may be NULL to skip observing.
+void      snake_env_reset  (SnakeEnv* env, unsigned char* observations);
+void      snake_env_step   (SnakeEnv* env, int* actions, float* rewards, unsigned char* dones,
+                            unsigned char* observations);
+void      snake_env_observe(SnakeEnv* env, unsigned char* observations);
+void      snake_env_close  (SnakeEnv* env);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SNAKE_ENV_H